@@ -4,13 +4,37 @@
 #include "omp.h"
 #include "assert.h"
 #include "sys/time.h"
+#include "dispatch.h"
+#include "backoff.h"
+#include "changes.h"
+#include "memstat.h"
+#include "hugepage.h"
+#include "fingerprint.h"
+#ifdef PERF_COUNTERS
+#include "perfctr.h"
+#endif
 #include <iostream>
+#include <atomic>
+#include <vector>
+#include <new>
+#include <stdint.h>
 
 
 typedef unsigned long long LL; // Use 64-bit unsigned long long for 64-bit system
 
 // Number of hash table buckets
+#ifndef NUM_BUCKETS
 #define NUM_BUCKETS 10000
+#endif
+
+// Log written by the benchmark with -DWAL, started afresh on every run
+#ifndef WAL_FILE
+#define WAL_FILE "table.wal"
+#endif
+
+#ifndef WAL_MODE
+#define WAL_MODE WAL_ASYNC
+#endif
 
 // Supported operations
 #define ADD (0)
@@ -19,27 +43,91 @@ typedef unsigned long long LL; // Use 64-bit unsigned long long for 64-bit syste
 
 LL items[NUM_ITEMS];    // Array of keys associated with operations
 LL op[NUM_ITEMS];       // Array of operations
-LL result[NUM_ITEMS];   // Array of outcomes
+LL result[NUM_ITEMS] __attribute__((aligned (64)));   // Array of outcomes
+
+#ifdef FRONT_CACHE
+// Per-thread front cache of Search results, compile with -DFRONT_CACHE
+// An entry is valid while the epoch of its bucket stripe is unchanged. A
+// change counts itself into the epoch before its CAS and out again, moving
+// the epoch on, after it; Search neither uses nor fills the cache while a
+// change to the stripe is under way
+#define FRONT_BITS 9        // log2 of the direct-mapped entries per thread
+#define FRONT_SLOTS (1<<FRONT_BITS)
+#define FRONT_STRIPES 4096  // Epoch counters shared by the buckets
+#define FRONT_BUSY 0xffffULL        // Changes under way, low bits of an epoch
+#define FRONT_DONE (1ULL<<16)       // One finished change
+
+class FrontEntry {
+public:
+  LL key;
+  uint64_t epoch;
+  unsigned state;   // 0 empty, 1 absent, 2 present
+};
+
+__thread FrontEntry front[FRONT_SLOTS];
+
+inline void FrontBegin(std::atomic<uint64_t>* e)
+{
+  e->fetch_add(1, std::memory_order_acq_rel);
+}
+
+inline void FrontEnd(std::atomic<uint64_t>* e)
+{
+  e->fetch_add(FRONT_DONE-1, std::memory_order_release);
+}
+#endif
 
 class __attribute__((aligned (16))) Node; // The generic node class
 
+// Layout of a next field: reference | version tag | mark bit (bit 0)
+// While changes are numbered (see changes.h) every update bumps a 16-bit tag
+// in the unused top bits, so the CAS that applies a numbered change fails if
+// the field changed after it was read, even back to the same reference
+typedef uintptr_t Word;
+#ifdef CHANGE_NUMBERED
+#if __WORDSIZE != 64
+#error "numbered changes need the unused top bits of 64-bit pointers"
+#endif
+#define TAG_SHIFT 48
+#define TAG_MASK (((Word)0xffff)<<TAG_SHIFT)
+#define TAG_UNIT (((Word)1)<<TAG_SHIFT)
+#else
+#define TAG_MASK ((Word)0)
+#define TAG_UNIT ((Word)0)
+#endif
+#define REF_MASK (~(TAG_MASK|(Word)1))
+
 class AtomicReference {
 public:
-  LL reference;
+  std::atomic<Word> reference;
 
   // Create a next field from a reference and mark bit
   AtomicReference(Node* ref, bool mark) {
-    reference = (LL)(ref) | mark;
+    reference.store((Word)(ref) | mark, std::memory_order_relaxed);
   }
 
   AtomicReference() {
-    reference = 0;
+    reference.store(0, std::memory_order_relaxed);
   }
 
-  bool CompareAndSet(Node* expectedRef, Node* newRef, bool oldMark, bool newMark);
-  Node* Get(bool* marked);
-  void Set(Node* newRef, bool newMark);
-  Node* GetReference();
+  // expected is a value previously returned by Load, tag included
+  // Strong CAS for one-shot attempts, weak CAS for use inside retry loops
+  // Success publishes the new value with release ordering
+  bool CompareAndSet(Word expected, Node* newRef, bool newMark);
+  bool WeakCompareAndSet(Word expected, Node* newRef, bool newMark);
+  Word Load(std::memory_order order = std::memory_order_acquire);
+  Node* Get(bool* marked, std::memory_order order = std::memory_order_acquire);
+  void Set(Node* newRef, bool newMark, std::memory_order order = std::memory_order_release);
+  Node* GetReference(std::memory_order order = std::memory_order_acquire);
+
+  // Decode a next field value as returned by Load
+  static Node* Ref(Word value) { return (Node*)(value & REF_MASK); }
+  static bool Mark(Word value) { return value & 1; }
+
+  // The value that replaces old: the version tag moves on by one
+  static Word Next(Word old, Node* newRef, bool newMark) {
+    return (Word)newRef | newMark | (((old & TAG_MASK) + TAG_UNIT) & TAG_MASK);
+  }
 };
 
 class LockFreeList;
@@ -49,40 +137,242 @@ class __attribute__((aligned (16))) Node {
 public:
   LL key;
   AtomicReference next;
+#ifdef COUNTING
+  std::atomic<long> count;  // Flushed total of the key's increments
+#endif
 
   Node(LL k) {
     key = k;
+#ifdef COUNTING
+    count.store(0, std::memory_order_relaxed);
+#endif
+  }
+
+  // Sentinels come from the heap and are counted with -DMEM_STATS;
+  // regular nodes are placed in arena chunks
+  static void* operator new(size_t bytes) { MemAlloc(bytes); return ::operator new(bytes); }
+  static void* operator new(size_t bytes, void* p) { return p; }
+  static void operator delete(void* p, size_t bytes) { MemFree(bytes); ::operator delete(p); }
+};
+
+// Per-thread node arena
+// Regular nodes are carved from chunks and never freed one at a time, so the
+// nodes that Delete unlinks are reclaimed too when Clear releases the chunks
+// Chunks go on huge pages with -DHUGE_PAGES, one page each
+#ifdef HUGE_PAGES
+#define ARENA_CHUNK (HUGE_PAGE_SIZE/sizeof(Node))
+#else
+#define ARENA_CHUNK 4096    // Nodes per chunk
+#endif
+
+class NodeArena {
+public:
+  std::vector<Node*> chunks;
+  Node* next;       // Next free node of the current chunk
+  Node* end;
+  long carved;      // Bytes handed out as nodes
+  NodeArena* link;  // Next arena in the registry
+  void* owner;      // Slot of the thread that carves from it
+
+  NodeArena(void* o) {
+    next = end = NULL;
+    carved = 0;
+    link = NULL;
+    owner = o;
+  }
+
+  Node* Get(LL key) {
+    if (next == end) {
+      next = (Node*)HugeAlloc(ARENA_CHUNK * sizeof(Node));
+      assert(next != NULL);
+      end = next + ARENA_CHUNK;
+      chunks.push_back(next);
+      MemReserve(ARENA_CHUNK * sizeof(Node));
+    }
+    carved += sizeof(Node);
+    MemCarve(sizeof(Node));
+    return new (next++) Node(key);
+  }
+
+  void Release() {
+    for (size_t c = 0; c < chunks.size(); c++) HugeFree(chunks[c], ARENA_CHUNK * sizeof(Node));
+    MemUnreserve(chunks.size() * ARENA_CHUNK * sizeof(Node), carved);
+    chunks.clear();
+    next = end = NULL;
+    carved = 0;
+  }
+};
+
+// A thread's arena of the table it used last; a thread that switches tables
+// looks its arena up in the other table's registry
+class ArenaSlot {
+public:
+  unsigned serial;  // Serial of the table, 0 for none
+  NodeArena* arena;
+};
+
+__thread ArenaSlot myArena;
+std::atomic<unsigned> tableSerials(0);
+
+// The arenas of one table, one per thread that carved nodes for it
+// A table never takes the serial of an earlier one, so a slot left over from
+// a deleted table cannot match a later table at the same address
+class ArenaSet {
+public:
+  std::atomic<NodeArena*> arenas;   // Every arena of the table
+  unsigned serial;
+
+  ArenaSet() {
+    arenas.store(NULL, std::memory_order_relaxed);
+    serial = tableSerials.fetch_add(1, std::memory_order_relaxed) + 1;
+  }
+
+  ~ArenaSet() {
+    NodeArena* a = arenas.load(std::memory_order_acquire);
+    while (a != NULL) {
+      NodeArena* next = a->link;
+      a->Release();
+      delete a;
+      a = next;
+    }
+  }
+
+  // The arena of the calling thread, created on first use
+  NodeArena* Mine() {
+    if (myArena.serial == serial) return myArena.arena;
+    NodeArena* a = arenas.load(std::memory_order_acquire);
+    while (a != NULL && a->owner != &myArena) a = a->link;
+    if (a == NULL) {
+      a = new NodeArena(&myArena);
+      a->link = arenas.load(std::memory_order_relaxed);
+      while (!arenas.compare_exchange_weak(a->link, a, std::memory_order_release, std::memory_order_relaxed));
+    }
+    myArena.serial = serial;
+    myArena.arena = a;
+    return a;
+  }
+
+  // Bytes handed out as nodes by every arena
+  long Carved() {
+    long bytes = 0;
+    for (NodeArena* a = arenas.load(std::memory_order_acquire); a != NULL; a = a->link) bytes += a->carved;
+    return bytes;
+  }
+
+  // Release the chunks of every arena in parallel
+  void Release() {
+    std::vector<NodeArena*> all;
+    for (NodeArena* a = arenas.load(std::memory_order_acquire); a != NULL; a = a->link) all.push_back(a);
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (size_t k = 0; k < all.size(); k++) all[k]->Release();
+  }
+};
+
+#ifdef COUNTING
+// Counting mode, compile with -DCOUNTING
+// Increment(key, delta) adds to a slot of the calling thread's buffer, keyed
+// by the key's node, so a hot key costs one uncontended add on a line the
+// thread owns. The buffer is flushed into the nodes every COUNT_BATCH
+// increments and when a slot is taken by another key, with one fetch_add per
+// key. Count(key, true) flushes every buffer first and is exact.
+#define COUNT_BITS 6        // log2 of the direct-mapped slots per thread
+#define COUNT_SLOTS (1<<COUNT_BITS)
+#define COUNT_BATCH 1024    // Increments between flushes of a buffer
+
+class CounterSlot {
+public:
+  Node* node;               // Node the delta belongs to, NULL if empty
+  std::atomic<long> delta;
+};
+
+// The owner changes slot nodes and drains slots under the lock; other
+// threads take the lock to drain. Adding to the delta of a slot whose node
+// is unchanged needs no lock.
+class CounterBuffer {
+public:
+  CounterSlot slots[COUNT_SLOTS];
+  omp_lock_t lock;
+  unsigned pending;         // Increments since the last flush, owner only
+  CounterBuffer* link;      // Next buffer in the registry
+  void* owner;              // Slot of the thread that increments through it
+
+  CounterBuffer(void* o) {
+    for (int i=0;i<COUNT_SLOTS;i++) {
+      slots[i].node=NULL;
+      slots[i].delta.store(0, std::memory_order_relaxed);
+    }
+    omp_init_lock(&lock);
+    pending=0;
+    link=NULL;
+    owner=o;
+  }
+
+  // Apply slot i to its node; called with the lock held
+  void Drain(int i) {
+    long d=slots[i].delta.exchange(0, std::memory_order_acq_rel);
+    if (d!=0) slots[i].node->count.fetch_add(d, std::memory_order_relaxed);
+  }
+
+  // Apply every slot, keeping the slots assigned
+  void Flush() {
+    omp_set_lock(&lock);
+    for (int i=0;i<COUNT_SLOTS;i++) {
+      if (slots[i].node!=NULL) Drain(i);
+    }
+    omp_unset_lock(&lock);
+  }
+
+  // Forget every slot without applying it; used by Clear
+  void Reset() {
+    omp_set_lock(&lock);
+    for (int i=0;i<COUNT_SLOTS;i++) {
+      slots[i].node=NULL;
+      slots[i].delta.store(0, std::memory_order_relaxed);
+    }
+    pending=0;
+    omp_unset_lock(&lock);
   }
 };
 
-// CompareAndSet wrapper
-bool AtomicReference::CompareAndSet(Node* expectedRef, Node* newRef, bool oldMark, bool newMark) {
-  LL oldVal = (LL)expectedRef | oldMark;
-  LL newVal = (LL)newRef | newMark;
-  LL oldValOut;
-  bool result;
+// A thread's counter buffer of the table it incremented last, as ArenaSlot
+class CounterRef {
+public:
+  unsigned serial;
+  CounterBuffer* buffer;
+};
+
+__thread CounterRef myCounters;
+#endif
 
-  asm(
-    "lock cmpxchgq %4, %1 \n setzb %0"
-    :"=qm"(result), "+m"(reference), "=a"(oldValOut)
-    :"a"(oldVal), "r"(newVal)
-    :
-  );
+bool AtomicReference::CompareAndSet(Word expected, Node* newRef, bool newMark) {
+  return reference.compare_exchange_strong(expected, Next(expected, newRef, newMark),
+                                           std::memory_order_release, std::memory_order_relaxed);
+}
+
+bool AtomicReference::WeakCompareAndSet(Word expected, Node* newRef, bool newMark) {
+  return reference.compare_exchange_weak(expected, Next(expected, newRef, newMark),
+                                         std::memory_order_release, std::memory_order_relaxed);
+}
 
-  return result;
+// Acquire loads pair with the release CAS that published the node, so the
+// key of the returned node is visible
+Word AtomicReference::Load(std::memory_order order) {
+  return reference.load(order);
 }
 
-Node* AtomicReference::Get(bool* marked) {
-  *marked = reference % 2;
-  return (Node*)((reference >> 1) << 1);
+Node* AtomicReference::Get(bool* marked, std::memory_order order) {
+  Word r = reference.load(order);
+  *marked = Mark(r);
+  return Ref(r);
 }
 
-void AtomicReference::Set(Node* newRef, bool newMark) {
-  reference = (LL)newRef | newMark;
+// Only used while no other thread can update the field
+void AtomicReference::Set(Node* newRef, bool newMark, std::memory_order order) {
+  reference.store(Next(reference.load(std::memory_order_relaxed), newRef, newMark), order);
 }
 
-Node* AtomicReference::GetReference() {
-  return (Node*)((reference >> 1) << 1);
+Node* AtomicReference::GetReference(std::memory_order order) {
+  return Ref(reference.load(order));
 }
 
 class Window
@@ -90,11 +380,13 @@ class Window
   public:
     Node* pred;         // Predecessor of node holding the key being searched
     Node* curr;         // The node holding the key being searched (if present)
+    Word link;          // pred->next as read when curr was found, the expected value of a CAS
 
-    Window(Node* myPred, Node* myCurr)
+    Window(Node* myPred, Node* myCurr, Word myLink)
     {
       pred=myPred;
       curr=myCurr;
+      link=myLink;
     }
 };
 
@@ -104,41 +396,157 @@ Find(Node* head, LL key)
   Node* pred;
   Node* curr;
   Node* succ;
-  bool marked[]={false};
+  Word link;          // pred->next as last read
+  Word next;          // curr->next as last read
   bool snip;
 
   retry: 
   while(true) {
      pred=head;
-     curr=pred->next.GetReference();
+     link=pred->next.Load();
+     curr=AtomicReference::Ref(link);
      while(true) {
-        succ=curr->next.Get(marked);
-        while(marked[0]) {
-           snip=pred->next.CompareAndSet(curr, succ, false, false);
-           if(!snip) goto retry;
+        next=curr->next.Load();
+        succ=AtomicReference::Ref(next);
+        while(AtomicReference::Mark(next)) {
+           snip=pred->next.CompareAndSet(link, succ, false);
+           if(!snip) {
+              // Back off, then resume from pred unless it was deleted meanwhile
+              Backoff();
+              link=pred->next.Load();
+              if(AtomicReference::Mark(link)) goto retry;
+              curr=AtomicReference::Ref(link);
+              next=curr->next.Load();
+              succ=AtomicReference::Ref(next);
+              continue;
+           }
+       link=AtomicReference::Next(link, succ, false);
        curr=succ;
-       succ=curr->next.Get(marked);
+       next=curr->next.Load();
+       succ=AtomicReference::Ref(next);
     }
     if (curr->key >= key) {
-           Window* w=new Window(pred, curr);
-       return *w;
+       return Window(pred, curr, link);
         }
         pred=curr;
+        link=next;
         curr=succ;
      }
   }
 }
 
+#ifdef ELIMINATION
+// Elimination array, compile with -DELIMINATION
+// An Add(k) and a Delete(k) that overlap may both return true without touching
+// the list: whether k is present or absent at the instant they meet, the pair
+// linearizes there in the order that leaves the table unchanged. An operation
+// whose CAS failed parks an offer in the slot of its key for up to ELIM_SPIN
+// pauses; an opposite operation on the same key takes it before it starts or
+// after a failed CAS of its own.
+#define ELIM_BITS 8         // log2 of the slots
+#define ELIM_SLOTS (1<<ELIM_BITS)
+#define ELIM_SPIN 128       // Pauses an offer waits to be taken
+
+// Offer states, below the sequence number in Offer::state
+#define OFFER_IDLE (0)
+#define OFFER_WAITING (1)
+#define OFFER_MATCHED (2)
+
+// One offer per thread, reused; never freed, since a thread may still read
+// an offer it saw in a slot after its owner has moved on
+class Offer {
+public:
+  std::atomic<LL> key;
+  std::atomic<int> op;
+  std::atomic<LL> state;    // Sequence number above two state bits
+
+  Offer() {
+    key.store(0, std::memory_order_relaxed);
+    op.store(0, std::memory_order_relaxed);
+    state.store(OFFER_IDLE, std::memory_order_relaxed);
+  }
+};
+
+std::atomic<Offer*> elimination[ELIM_SLOTS];
+__thread Offer* myOffer;
+
+inline std::atomic<Offer*>* OfferSlot(LL key) {
+  return &elimination[(key*0x9E3779B97F4A7C15ULL)>>(64-ELIM_BITS)];
+}
+
+// Take an offer of the opposite operation on key, if one is parked
+// The state CAS fails if the owner withdrew, so key and op were read from
+// the offer that is taken
+inline bool TakeOffer(LL key, int op) {
+  Offer* o=OfferSlot(key)->load(std::memory_order_acquire);
+  if (o==NULL) return false;
+  LL st=o->state.load(std::memory_order_acquire);
+  if ((st&3)!=OFFER_WAITING || o->key.load(std::memory_order_relaxed)!=key
+      || o->op.load(std::memory_order_relaxed)==op) return false;
+  return o->state.compare_exchange_strong(st, (st&~3ULL)|OFFER_MATCHED,
+                                          std::memory_order_acq_rel, std::memory_order_relaxed);
+}
+
+// Park an offer for key in its slot and wait for it to be taken
+// Only the owner clears the slot, after withdrawing or being taken
+inline bool ParkOffer(LL key, int op) {
+  std::atomic<Offer*>* slot=OfferSlot(key);
+  if (slot->load(std::memory_order_relaxed)!=NULL) return false;  // Slot busy
+  if (myOffer==NULL) {
+    myOffer=new Offer();
+    MemAlloc(sizeof(Offer));
+  }
+  Offer* me=myOffer;
+  LL seq=(me->state.load(std::memory_order_relaxed)&~3ULL)+4;
+  me->key.store(key, std::memory_order_relaxed);
+  me->op.store(op, std::memory_order_relaxed);
+  me->state.store(seq|OFFER_WAITING, std::memory_order_release);
+  Offer* expected=NULL;
+  bool parked=slot->compare_exchange_strong(expected, me, std::memory_order_release, std::memory_order_relaxed);
+  bool taken=false;
+  for (int k=0; parked && k<ELIM_SPIN && !taken; k++) {
+    CpuRelax();
+    taken=(me->state.load(std::memory_order_acquire)&3)==OFFER_MATCHED;
+  }
+  if (!taken) {
+    // Withdraw; failing means the offer was taken meanwhile
+    LL st=seq|OFFER_WAITING;
+    taken=!me->state.compare_exchange_strong(st, seq|OFFER_IDLE,
+                                             std::memory_order_acq_rel, std::memory_order_acquire);
+  }
+  if (parked) {
+    expected=me;
+    slot->compare_exchange_strong(expected, NULL, std::memory_order_relaxed);
+  }
+  return taken;
+}
+#endif
+
+// Predicate of EraseIf, called with the key and the caller's argument
+typedef bool (*KeyPredicate)(LL key, void* arg);
+
+// The filter is a Bloom word over every key added to the bucket since the
+// last Clear. Add sets its bits before linking the node, and Delete and
+// EraseIf leave them: a concurrent Add may have set bits for a node it has
+// not linked yet, so no lock-free rebuild can tell which bits are still
+// needed. Under add/delete churn the word therefore fills up and Search stops
+// rejecting keys early, until Clear resets it.
+
 class LockFreeList
 {
   public:
     Node* head;     // Head sentinel
     Node* tail;     // Tail sentinel
+    std::atomic<uint64_t> filter;   // Superset of the fingerprints of the keys
 
     bool Add(Node*);
-    bool Add(LL, Node*);
+    bool Add(LL, Node*, ArenaSet*);
     bool Search(LL);
     bool Delete(LL);
+    long EraseIf(KeyPredicate, void*);
+#ifdef COUNTING
+    Node* Get(LL, bool, bool*, ArenaSet*);
+#endif
 
     LockFreeList()
     {
@@ -146,16 +554,30 @@ class LockFreeList
 
       tail=new Node((LL)0xffffffffffffffff);
 
-      head->next.Set(tail, false);
-      tail->next.Set(NULL, false);
+      head->next.Set(tail, false, std::memory_order_relaxed);
+      tail->next.Set(NULL, false, std::memory_order_relaxed);
+      filter.store(0, std::memory_order_relaxed);
     }
 
     LockFreeList(LL key)
     {
       head=new Node(key);
       tail=NULL;
-      head->next.Set(NULL, false);
+      head->next.Set(NULL, false, std::memory_order_relaxed);
+      filter.store(0, std::memory_order_relaxed);
+    }
+
+    // List over a sentinel that is already linked
+    LockFreeList(Node* sentinel)
+    {
+      head=sentinel;
+      tail=NULL;
+      filter.store(0, std::memory_order_relaxed);
     }
+
+    // Counted with -DMEM_STATS
+    static void* operator new(size_t bytes) { MemAlloc(bytes); return ::operator new(bytes); }
+    static void operator delete(void* p, size_t bytes) { MemFree(bytes); ::operator delete(p); }
 };
 
 bool
@@ -168,31 +590,100 @@ LockFreeList::Add(Node* pointer)
      Node* curr = w.curr;
      if (curr->key==key) return false;
      else{
-        pointer->next.Set(curr, false);
-        if (pred->next.CompareAndSet(curr, pointer, false, false))
-       return true;
+        // Not yet reachable, the CAS below publishes it
+        pointer->next.Set(curr, false, std::memory_order_relaxed);
+        LL seq=ChangeSequence();
+        if (pred->next.WeakCompareAndSet(w.link, pointer, false)) {
+           BackoffDone();
+           RecordChange(CHANGE_ADD, key, seq);
+           MemKeys(1);
+           return true;
+        }
+        Backoff();
      }
   }
 }
 
 bool
-LockFreeList::Add(LL key, Node *n)
+LockFreeList::Add(LL key, Node *n, ArenaSet* nodes)
 {
+  // Set before linking, or a Search after the link could miss the key
+  uint64_t fp=Fingerprint(key);
+  if ((filter.load(std::memory_order_relaxed)&fp) != fp)
+     filter.fetch_or(fp, std::memory_order_acq_rel);
   while (true) {
       Window w=Find(head, key);
       Node* pred=w.pred;
       Node* curr = w.curr;
-      if (curr->key==key) return false;
+      if (curr->key==key) {
+         if (n!=NULL) MemRetire(sizeof(Node));  // Left over from a failed CAS
+         return false;
+      }
       else{
-         Node* pointer=new Node(key);
-         pointer->next.Set(curr, false);
-         if (pred->next.CompareAndSet(curr, pointer, false, false))
-        return true;
+         // A node left over from a failed CAS is reused on the next attempt
+         if (n==NULL) n=nodes->Mine()->Get(key);
+         Node* pointer=n;
+         pointer->next.Set(curr, false, std::memory_order_relaxed);
+         LL seq=ChangeSequence();
+         if (pred->next.WeakCompareAndSet(w.link, pointer, false)) {
+            BackoffDone();
+            RecordChange(CHANGE_ADD, key, seq);
+            MemKeys(1);
+            return true;
+         }
+#ifdef ELIMINATION
+         if (TakeOffer(key, ADD) || ParkOffer(key, ADD)) {
+            MemRetire(sizeof(Node));
+            return true;
+         }
+#endif
+         Backoff();
       }
    }
 }
 
+#ifdef COUNTING
+// The node holding key, or NULL if it is absent; with create set an absent
+// key is added, with a node from nodes, and *added tells whether this call
+// added it
+Node*
+LockFreeList::Get(LL key, bool create, bool* added, ArenaSet* nodes)
+{
+  *added=false;
+  if (!create) {
+     Window w=Find(head, key);
+     return w.curr->key==key ? w.curr : NULL;
+  }
+  uint64_t fp=Fingerprint(key);
+  if ((filter.load(std::memory_order_relaxed)&fp) != fp)
+     filter.fetch_or(fp, std::memory_order_acq_rel);
+  Node* n=NULL;
+  while (true) {
+     Window w=Find(head, key);
+     if (w.curr->key==key) {
+        if (n!=NULL) MemRetire(sizeof(Node));
+        return w.curr;
+     }
+     if (n==NULL) n=nodes->Mine()->Get(key);
+     n->next.Set(w.curr, false, std::memory_order_relaxed);
+     LL seq=ChangeSequence();
+     if (w.pred->next.WeakCompareAndSet(w.link, n, false)) {
+        BackoffDone();
+        RecordChange(CHANGE_ADD, key, seq);
+        MemKeys(1);
+        *added=true;
+        return n;
+     }
+     Backoff();
+  }
+}
+#endif
+
 bool LockFreeList::Search(LL key) {
+    uint64_t fp = Fingerprint(key);
+    if ((filter.load(std::memory_order_acquire) & fp) != fp) {
+        return false; // Key was never added to this bucket.
+    }
     bool marked = false;
     Node* curr = head->next.GetReference();
     while (curr != tail && curr->key < key) {
@@ -218,15 +709,74 @@ LockFreeList::Delete(LL key)
         return false;
      }
      else{
-        Node* succ = curr->next.GetReference();
-        snip=curr->next.CompareAndSet(succ, succ, false, true);
-    if (!snip) continue;
-    pred->next.CompareAndSet(curr, succ, false, false);
+        Word next = curr->next.Load();
+        Node* succ = AtomicReference::Ref(next);
+        LL seq=ChangeSequence();
+        snip=!AtomicReference::Mark(next) && curr->next.WeakCompareAndSet(next, succ, true);
+    if (!snip) {
+#ifdef ELIMINATION
+       if (TakeOffer(key, DELETE) || ParkOffer(key, DELETE)) return true;
+#endif
+       Backoff();
+       continue;
+    }
+    pred->next.CompareAndSet(w.link, succ, false);
+    BackoffDone();
+    RecordChange(CHANGE_DELETE, key, seq);
+    MemKeys(-1);
+    MemRetire(sizeof(Node));
     return true;
      }
   }
 }
 
+// Delete every key of the bucket for which match returns true, in one pass
+// A matching node is marked and then snipped from its predecessor, as Delete
+// does; marked nodes met on the way are snipped too. A failed snip leaves the
+// node marked and resumes from a fresh Find, which removes it.
+// Returns the number of keys this call marked
+long
+LockFreeList::EraseIf(KeyPredicate match, void* arg)
+{
+  long removed=0;
+  Node* pred=head;
+  Word link=head->next.Load();
+  Node* curr=AtomicReference::Ref(link);
+  // Regular keys never have the top bit set; the next sentinel or the tail ends the bucket
+  while (!(curr->key&0x8000000000000000ULL)) {
+     Word next=curr->next.Load();
+     Node* succ=AtomicReference::Ref(next);
+     if (!AtomicReference::Mark(next)) {
+        if (!match(curr->key, arg)) {
+           pred=curr;
+           link=next;
+           curr=succ;
+           continue;
+        }
+        LL seq=ChangeSequence();
+        if (!curr->next.WeakCompareAndSet(next, succ, true)) {
+           Backoff();
+           continue;   // Reread the node
+        }
+        BackoffDone();
+        RecordChange(CHANGE_DELETE, curr->key, seq);
+        MemKeys(-1);
+        MemRetire(sizeof(Node));
+        removed++;
+     }
+     if (pred->next.CompareAndSet(link, succ, false)) {
+        link=AtomicReference::Next(link, succ, false);
+        curr=succ;
+     } else {
+        Window w=Find(head, curr->key);
+        pred=w.pred;
+        curr=w.curr;
+        link=w.link;
+     }
+  }
+  return removed;
+}
+
 class LockFreeHashTable
 {
   private:
@@ -242,34 +792,388 @@ class LockFreeHashTable
     {
       return key%NUM_BUCKETS;
     }
+
+    // The bucket whose sentinel is linked in front of bucket b's: b with its
+    // top bit cleared, so initialization recurses at most log2(b) times
+    LL Parent(LL b)
+    {
+      LL p=b;
+      while (p&(p-1)) p&=p-1;
+      return b^p;
+    }
+
+#ifdef LAZY_BUCKETS
+    LockFreeList* Initialize(LL b);
+#endif
+
+    // Bucket b, for an operation that adds to it
+    LockFreeList* Bucket(LL b)
+    {
+#ifdef LAZY_BUCKETS
+      LockFreeList* l=__atomic_load_n(&buckets[b], __ATOMIC_ACQUIRE);
+      return l!=NULL ? l : Initialize(b);
+#else
+      return buckets[b];
+#endif
+    }
+
+    // Bucket b, or NULL if it was never touched
+    LockFreeList* Existing(LL b)
+    {
+#ifdef LAZY_BUCKETS
+      return __atomic_load_n(&buckets[b], __ATOMIC_ACQUIRE);
+#else
+      return buckets[b];
+#endif
+    }
+
+    void Empty();
+    long Keys();
+#ifdef COUNTING
+    CounterBuffer* Counters();
+#endif
     
   public:
     
     LockFreeList* buckets[NUM_BUCKETS];
+    ArenaSet nodes;     // Regular nodes, released whole by Clear
+#ifdef COUNTING
+    std::atomic<CounterBuffer*> counterBuffers;   // Every buffer of the table
+#endif
+#ifdef FRONT_CACHE
+    std::atomic<uint64_t> epochs[FRONT_STRIPES];
+#endif
 
     bool Add(LL, Node*);
     bool Delete(LL);
     bool Search(LL);
 
+    // Sentinel keys grow with the bucket index, so the sentinels are linked
+    // in one pass in index order; with -DLAZY_BUCKETS only bucket 0 is set up
+    // and the others on the first Add that hashes to them
     LockFreeHashTable()
     {
+      MemAlloc(sizeof(LockFreeHashTable));
       buckets[0]=new LockFreeList();
       int i;
+#ifdef LAZY_BUCKETS
+      for(i=1;i<NUM_BUCKETS;i++){
+        buckets[i]=NULL;
+      }
+#else
+      Node* prev=buckets[0]->head;
       for(i=1;i<NUM_BUCKETS;i++){
         buckets[i]=new LockFreeList(MakeSentinelKey(i));
-        buckets[0]->Add(buckets[i]->head);
+        prev->next.Set(buckets[i]->head, false, std::memory_order_relaxed);
+        prev=buckets[i]->head;
       }
+      prev->next.Set(buckets[0]->tail, false, std::memory_order_relaxed);
+#endif
+#ifdef COUNTING
+      counterBuffers.store(NULL, std::memory_order_relaxed);
+#endif
+#ifdef FRONT_CACHE
+      for(i=0;i<FRONT_STRIPES;i++){
+        epochs[i].store(0, std::memory_order_relaxed);
+      }
+#endif
     }
 
+    ~LockFreeHashTable();
+
+    void Clear();
+    long EraseIf(KeyPredicate, void*);
+#ifdef WAL
+    bool Snapshot(const char*);
+    long Recover(const char*, const char*);
+#endif
+#ifdef COUNTING
+    void Increment(LL, long);
+    long Count(LL, bool);
+    void Flush();
+#endif
+
 } h;
 
+// Not a change of the keys, so nothing is logged
+// The global table is left to the exit of the process; emptying it would run
+// OpenMP loops during static destruction
+LockFreeHashTable::~LockFreeHashTable()
+{
+  if (this==&h) return;
+  Empty();
+  delete buckets[0]->tail;
+  for(int i=0;i<NUM_BUCKETS;i++){
+    if (buckets[i]==NULL) continue;
+    delete buckets[i]->head;
+    delete buckets[i];
+  }
+#ifdef COUNTING
+  CounterBuffer* c=counterBuffers.load(std::memory_order_acquire);
+  while (c!=NULL) {
+    CounterBuffer* next=c->link;
+    omp_destroy_lock(&c->lock);
+    delete c;
+    MemFree(sizeof(CounterBuffer));
+    c=next;
+  }
+#endif
+  MemFree(sizeof(LockFreeHashTable));
+}
+
+// The keys of the table, counted bucket by bucket; writers must be quiescent
+long
+LockFreeHashTable::Keys()
+{
+  long keys=0;
+  #pragma omp parallel for schedule(static, 256) reduction(+:keys)
+  for(int i=0;i<NUM_BUCKETS;i++){
+    LockFreeList* l=Existing(i);
+    if (l==NULL) continue;
+    // Regular keys never have the top bit set; the next sentinel or the tail ends the bucket
+    bool marked;
+    Node* curr=l->head->next.GetReference();
+    while (!(curr->key&0x8000000000000000ULL)) {
+      Node* next=curr->next.Get(&marked);
+      if (!marked) keys++;
+      curr=next;
+    }
+  }
+  return keys;
+}
+
+#ifdef COUNTING
+// The counter buffer of the calling thread, created on first use
+CounterBuffer*
+LockFreeHashTable::Counters()
+{
+  if (myCounters.serial==nodes.serial) return myCounters.buffer;
+  CounterBuffer* c=counterBuffers.load(std::memory_order_acquire);
+  while (c!=NULL && c->owner!=&myCounters) c=c->link;
+  if (c==NULL) {
+    c=new CounterBuffer(&myCounters);
+    MemAlloc(sizeof(CounterBuffer));
+    c->link=counterBuffers.load(std::memory_order_relaxed);
+    while (!counterBuffers.compare_exchange_weak(c->link, c, std::memory_order_release, std::memory_order_relaxed));
+  }
+  myCounters.serial=nodes.serial;
+  myCounters.buffer=c;
+  return c;
+}
+#endif
+
+// Drop every key; no other operation may run concurrently
+// The write-ahead log gets one record for the whole Clear
+void
+LockFreeHashTable::Clear()
+{
+  WalAppend(WAL_CLEAR, 0, ChangeSequence());
+  Empty();
+  WalSync();
+}
+
+// Drop every key without logging it, for Clear and the destructor
+// Each sentinel is pointed back at the next one in parallel and the node
+// arenas of this table are released whole, so the table is usable again at
+// once
+void
+LockFreeHashTable::Empty()
+{
+#ifdef MEM_STATS
+  // Carved nodes that are not keys were counted as retired
+  long keys=Keys();
+  long retired=nodes.Carved()-keys*(long)sizeof(Node);
+#endif
+#ifdef LAZY_BUCKETS
+  // Initialized buckets keep their sentinels, linked to the next one in order
+  // Each thread links the sentinels of one block of indices in parallel, then
+  // the blocks are joined in order; bucket 0 is always initialized
+  int blocks=omp_get_max_threads();
+  std::vector<Node*> first(blocks, (Node*)NULL), last(blocks, (Node*)NULL);
+  #pragma omp parallel for schedule(static, 1)
+  for(int k=0;k<blocks;k++){
+    int lo=(long)NUM_BUCKETS*k/blocks, hi=(long)NUM_BUCKETS*(k+1)/blocks;
+    Node* prev=NULL;
+    for(int i=lo;i<hi;i++){
+      if (buckets[i]==NULL) continue;
+      if (prev!=NULL) prev->next.Set(buckets[i]->head, false, std::memory_order_relaxed);
+      else first[k]=buckets[i]->head;
+      prev=buckets[i]->head;
+      buckets[i]->filter.store(0, std::memory_order_relaxed);
+    }
+    last[k]=prev;
+  }
+  Node* prev=NULL;
+  for(int k=0;k<blocks;k++){
+    if (first[k]==NULL) continue;
+    if (prev!=NULL) prev->next.Set(first[k], false, std::memory_order_relaxed);
+    prev=last[k];
+  }
+  prev->next.Set(buckets[0]->tail, false, std::memory_order_relaxed);
+#else
+  #pragma omp parallel for schedule(static, 256)
+  for(int i=0;i<NUM_BUCKETS;i++){
+    Node* next=(i+1<NUM_BUCKETS) ? buckets[i+1]->head : buckets[0]->tail;
+    buckets[i]->head->next.Set(next, false, std::memory_order_relaxed);
+    buckets[i]->filter.store(0, std::memory_order_relaxed);
+  }
+#endif
+  nodes.Release();
+#ifdef MEM_STATS
+  // The keys and the retired nodes went with the arenas
+  MemKeys(-keys);
+  MemReclaim(retired);
+#endif
+#ifdef COUNTING
+  // Buffered deltas point into the arenas just released
+  for(CounterBuffer* c=counterBuffers.load(std::memory_order_acquire); c!=NULL; c=c->link){
+    c->Reset();
+  }
+#endif
+#ifdef FRONT_CACHE
+  for(int i=0;i<FRONT_STRIPES;i++){
+    FrontBegin(&epochs[i]);
+    FrontEnd(&epochs[i]);
+  }
+#endif
+}
+
+#ifdef COUNTING
+// Add delta to the count of key, adding the key if it is absent
+// The delta is buffered by the calling thread; a slot whose node was deleted
+// is drained into the dead node, so increments racing a Delete are dropped
+// with it
+void
+LockFreeHashTable::Increment(LL key, long delta)
+{
+  CounterBuffer* c=Counters();
+  CounterSlot* s=&c->slots[(key*0x9E3779B97F4A7C15ULL)>>(64-COUNT_BITS)];
+  bool marked=false;
+  Node* n=s->node;
+  if (n!=NULL && n->key==key) n->next.Get(&marked);
+  if (n==NULL || n->key!=key || marked) {
+     LL b=Hash(key);
+     bool added;
+#ifdef FRONT_CACHE
+     FrontBegin(&epochs[b%FRONT_STRIPES]);
+     Node* fresh=Bucket(b)->Get(key, true, &added, &nodes);
+     FrontEnd(&epochs[b%FRONT_STRIPES]);
+#else
+     Node* fresh=Bucket(b)->Get(key, true, &added, &nodes);
+#endif
+     omp_set_lock(&c->lock);
+     if (n!=NULL) c->Drain(s-c->slots);
+     s->node=fresh;
+     omp_unset_lock(&c->lock);
+     if (added) WalSync();
+  }
+  s->delta.fetch_add(delta, std::memory_order_relaxed);
+  if (++c->pending>=COUNT_BATCH) {
+     c->Flush();
+     c->pending=0;
+  }
+}
+
+// Apply the buffered deltas of every thread
+void
+LockFreeHashTable::Flush()
+{
+  for(CounterBuffer* c=counterBuffers.load(std::memory_order_acquire); c!=NULL; c=c->link){
+    c->Flush();
+  }
+}
+
+// The count of key, 0 if it is absent; with exact set every buffer is flushed
+// first, otherwise deltas still buffered by other threads are left out
+long
+LockFreeHashTable::Count(LL key, bool exact)
+{
+  if (exact) Flush();
+  else if (myCounters.serial==nodes.serial) myCounters.buffer->Flush();
+  LockFreeList* l=Existing(Hash(key));
+  if (l==NULL) return 0;
+  bool added;
+  Node* n=l->Get(key, false, &added, NULL);
+  return n!=NULL ? n->count.load(std::memory_order_relaxed) : 0;
+}
+#endif
+
+// Delete every key for which match returns true, sweeping the buckets in
+// parallel; safe alongside Add, Delete and Search, and match may be called
+// from any thread. Returns the number of keys deleted
+long
+LockFreeHashTable::EraseIf(KeyPredicate match, void* arg)
+{
+  long removed=0;
+  #pragma omp parallel for schedule(dynamic, 256) reduction(+:removed)
+  for(int i=0;i<NUM_BUCKETS;i++){
+    LockFreeList* l=Existing(i);
+    if (l==NULL) continue;
+#ifdef FRONT_CACHE
+    FrontBegin(&epochs[i%FRONT_STRIPES]);
+    long n=l->EraseIf(match, arg);
+    FrontEnd(&epochs[i%FRONT_STRIPES]);
+#else
+    long n=l->EraseIf(match, arg);
+#endif
+    removed+=n;
+  }
+  WalSync();
+  return removed;
+}
+
+#ifdef LAZY_BUCKETS
+// Link the sentinel of bucket b behind its parent's and publish the bucket
+// Racing threads agree on the first sentinel linked; the loser of the
+// publishing CAS drops its list object, which never escaped
+LockFreeList*
+LockFreeHashTable::Initialize(LL b)
+{
+  LockFreeList* parent=Bucket(Parent(b));
+  LL key=MakeSentinelKey(b);
+  Node* s=new Node(key);
+  Node* head;
+  while (true) {
+     Window w=Find(parent->head, key);
+     if (w.curr->key==key) {
+        delete s;
+        head=w.curr;
+        break;
+     }
+     s->next.Set(w.curr, false, std::memory_order_relaxed);
+     if (w.pred->next.WeakCompareAndSet(w.link, s, false)) {
+        head=s;
+        break;
+     }
+  }
+  LockFreeList* mine=new LockFreeList(head);
+  LockFreeList* expected=NULL;
+  if (__atomic_compare_exchange_n(&buckets[b], &expected, mine, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+     return mine;
+  delete mine;
+  return expected;
+}
+#endif
+
 bool
 LockFreeHashTable::Add(LL k, Node *n)
 {
   LL key=k;
   LL b=Hash(key);
   assert(b<NUM_BUCKETS);
-  return buckets[b]->Add(key, n);
+#ifdef ELIMINATION
+  if (TakeOffer(key, ADD)) return true;
+#endif
+#ifdef FRONT_CACHE
+  FrontBegin(&epochs[b%FRONT_STRIPES]);
+  bool added=Bucket(b)->Add(key, n, &nodes);
+  FrontEnd(&epochs[b%FRONT_STRIPES]);
+  if (!added) return false;
+#else
+  if (!Bucket(b)->Add(key, n, &nodes)) return false;
+#endif
+  WalSync();
+  return true;
 }
 
 bool LockFreeHashTable::Delete(LL k)
@@ -277,7 +1181,21 @@ bool LockFreeHashTable::Delete(LL k)
   LL key=k;
   LL b=Hash(key);
   assert(b<NUM_BUCKETS);
-  return buckets[b]->Delete(key);
+#ifdef ELIMINATION
+  if (TakeOffer(key, DELETE)) return true;
+#endif
+  LockFreeList* l=Existing(b);
+  if (l==NULL) return false;	// Nothing was ever added to the bucket
+#ifdef FRONT_CACHE
+  FrontBegin(&epochs[b%FRONT_STRIPES]);
+  bool deleted=l->Delete(key);
+  FrontEnd(&epochs[b%FRONT_STRIPES]);
+  if (!deleted) return false;
+#else
+  if (!l->Delete(key)) return false;
+#endif
+  WalSync();
+  return true;
 }
 
 bool LockFreeHashTable::Search(LL k)
@@ -285,27 +1203,126 @@ bool LockFreeHashTable::Search(LL k)
   LL key=k;
   LL b=Hash(key);
   assert(b<NUM_BUCKETS);
-  return buckets[b]->Search(key);
+  LockFreeList* l=Existing(b);
+  if (l==NULL) return false;	// Nothing was ever added to the bucket
+#ifdef FRONT_CACHE
+  // A result is only cached if the epoch was quiet and unchanged across the
+  // bucket read, so it reflects exactly the changes the epoch counts
+  std::atomic<uint64_t>* epoch=&epochs[b%FRONT_STRIPES];
+  uint64_t e=epoch->load(std::memory_order_acquire);
+  bool quiet=(e&FRONT_BUSY)==0;
+  FrontEntry* f=&front[(key*0x9E3779B97F4A7C15ULL)>>(64-FRONT_BITS)];
+  if (quiet && f->key==key && f->epoch==e && f->state!=0) return f->state==2;
+  bool found=l->Search(key);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (quiet && epoch->load(std::memory_order_relaxed)==e) {
+     f->key=key;
+     f->epoch=e;
+     f->state=1+found;
+  }
+  return found;
+#else
+  return l->Search(key);
+#endif
+}
+
+#ifdef WAL
+// Write every key to a snapshot for Recover
+// Writers must be quiescent, so that every change numbered up to the recorded
+// sequence number is in the keys and no later one
+bool
+LockFreeHashTable::Snapshot(const char* path)
+{
+  LL seq=WalSequence();
+  std::vector<LL> keys;
+  // Every bucket's sentinel is on the chain from bucket 0's head, whose key is
+  // 0 rather than a sentinel key, so the walk starts after it
+  Node* tail=buckets[0]->tail;
+  for(Node* curr=buckets[0]->head->next.GetReference(std::memory_order_acquire); curr!=tail; ){
+    bool marked;
+    Node* next=curr->next.Get(&marked);
+    if (!marked && !(curr->key&0x8000000000000000ULL)) keys.push_back(curr->key);
+    curr=next;
+  }
+  return WalSaveSnapshot(path, keys.empty() ? NULL : &keys[0], keys.size(), seq);
+}
+
+static void
+Replay(int op, unsigned long long key, void* arg)
+{
+  LockFreeHashTable* t=(LockFreeHashTable*)arg;
+  if (op==WAL_ADD) t->Add(key, NULL);
+  else if (op==WAL_DELETE) t->Delete(key);
+  else t->Clear();
 }
 
-void Thread (int tid)
+// Rebuild an empty table from a snapshot (NULL for none) and the records of
+// the log after it. Run before WalOpen, so the replay is not logged again
+// Returns the number of log records applied, or -1 if a file cannot be read
+long
+LockFreeHashTable::Recover(const char* snapshot, const char* log)
+{
+  LL seq=0;
+  if (snapshot!=NULL && WalLoadSnapshot(snapshot, Replay, this, &seq)<0) return -1;
+  return WalReplay(log, seq, Replay, this);
+}
+#endif
+
+// The benchmark; tests that include this file define LFHT_NO_MAIN
+#ifndef LFHT_NO_MAIN
+#ifdef PERF_COUNTERS
+PerfGroup* counters;    // One counter group per thread
+PerfTotals totals;
+#endif
+
+#ifdef CHANGE_STREAM
+// Drain the change stream in batches until the workers are done and it is empty
+long Consume(std::atomic<int>* running)
+{
+  ChangeRecord batch[1024];
+  long drained=0;
+  while (true) {
+    bool last=running->load(std::memory_order_acquire)==0;
+    long n=DrainChanges(batch, 1024);
+    drained+=n;
+    if (n==0 && last) return drained;
+    if (n==0) sched_yield();    // Let a worker run if the machine is oversubscribed
+  }
+}
+#endif
+
+// Each thread drains its own contiguous range, then steals from the others
+
+void Thread (int tid, Dispatcher* d)
 {  
-  int i;
-#pragma omp for
-  for (i=0;i<NUM_ITEMS;i++) {
-     unsigned int item = items[i];
-     switch(op[i]){
-       case ADD:
-         result[i]=10+h.Add(item, NULL);
-         break;
-       case DELETE:
-         result[i]=20+h.Delete(item);
-         break;
-       case SEARCH:
-         result[i]=30+h.Search(item);
-         break;
-     }
+  long i, begin, end;
+#ifdef PERF_COUNTERS
+  counters[tid].Start();
+#endif
+  while (d->Next(tid, &begin, &end)) {
+    for (i=begin;i<end;i++) {
+       unsigned int item = items[i];
+       switch(op[i]){
+         case ADD:
+#ifdef COUNTING
+           h.Increment(item, 1);
+           result[i]=11;
+#else
+           result[i]=10+h.Add(item, NULL);
+#endif
+           break;
+         case DELETE:
+           result[i]=20+h.Delete(item);
+           break;
+         case SEARCH:
+           result[i]=30+h.Search(item);
+           break;
+       }
+    }
   }
+#ifdef PERF_COUNTERS
+  counters[tid].Stop();
+#endif
 }
 
 int main(int argc, char** argv) {
@@ -341,20 +1358,83 @@ int main(int argc, char** argv) {
   for(;i<NUM_ITEMS;i++){
     op[i]=SEARCH;
   }
+  ShuffleOps(op, NUM_ITEMS);
+
+  Dispatcher d(NUM_ITEMS, num_threads, AFFINITY);
+
+#ifdef PERF_COUNTERS
+  counters = new PerfGroup[num_threads];
+#endif
+
+  // Pin the team before timing; OpenMP reuses the same threads below
+  #pragma omp parallel
+  {
+    d.Pin(omp_get_thread_num());
+#ifdef PERF_COUNTERS
+    counters[omp_get_thread_num()].Open();
+#endif
+  }
   
+#ifdef WAL
+  unlink(WAL_FILE);
+  if (!WalOpen(WAL_FILE, WAL_MODE)) {
+     printf("Cannot open %s.\nAborting...\n", WAL_FILE);
+     exit(1);
+  }
+#endif
+
   struct timeval tv0,tv1;
   struct timezone tz0,tz1;
 
   gettimeofday(&tv0,&tz0);
+#ifdef CHANGE_STREAM
+  // One more thread consumes the change stream while the workers run
+  std::atomic<int> running(num_threads);
+  long changes=0;
+  ChangeConsumer();
+  #pragma omp parallel num_threads(num_threads+1)
+  {
+    int tid=omp_get_thread_num();
+    if (tid==num_threads) {
+      changes=Consume(&running);
+    } else {
+      Thread(tid, &d);
+      running.fetch_sub(1, std::memory_order_release);
+    }
+  }
+#else
   #pragma omp parallel
   {
     // printf("Thread %d of %d\n", omp_get_thread_num(), omp_get_num_threads());
-    Thread(omp_get_thread_num());
+    Thread(omp_get_thread_num(), &d);
 
   }
+#endif
+#ifdef COUNTING
+  h.Flush();
+#endif
+#ifdef WAL
+  // The run ends when its last change is durable
+  WalClose();
+#endif
   gettimeofday(&tv1,&tz1);
 
   printf("%lf\n",((float)((tv1.tv_sec-tv0.tv_sec)*1000000+(tv1.tv_usec-tv0.tv_usec)))/1000.0);
+
+#ifdef CHANGE_STREAM
+  printf("changes %ld dropped %ld\n", changes, ChangeDrops());
+#endif
+#ifdef WAL
+  WalReport();
+#endif
+  HugeReport();
+  MemReport();
+#ifdef PERF_COUNTERS
+  for(i=0;i<num_threads;i++){
+    counters[i].Accumulate(&totals);
+  }
+  totals.Report(NUM_ITEMS);
+#endif
   
 //   printf("Operation results:\n");
 // for(int i = 0; i < NUM_ITEMS; i++) {
@@ -402,3 +1482,4 @@ int main(int argc, char** argv) {
   
   return 0;
 }
+#endif // LFHT_NO_MAIN
@@ -39,7 +39,7 @@ policies, either expressed or implied, of Indian Institute of Technology Kanpur.
 
  Compilation flags: -O3 -pthread -DNUM_ITEMS=num_ops -DNUM_THREADS=num_threads -DKEYS=num_keys
 
- Optional compilation flag: -DPRE_ALLOCATE
+ Optional compilation flags: -DNUM_BUCKETS=n -DLAZY_BUCKETS -DPRE_ALLOCATE -DRECYCLE -DCACHE -DKEY32 -DHUGE_PAGES -DAFFINITY=1|2 -DPERF_COUNTERS
 
  NUM_ITEMS is the total number of operations (mix of add, delete, search) to execute.
 
@@ -49,8 +49,39 @@ policies, either expressed or implied, of Indian Institute of Technology Kanpur.
  The paper cited below states that the key range is [0, KEYS-1]. However, we have shifted the range by +10 so that
  the head sentinel key (the minimum key) can be chosen as zero. Any positive shift other than +10 would also work.
 
+ A thread whose CAS fails backs off for a random, adaptively growing delay (see backoff.h; -DBACKOFF_MAX=0 turns
+ it off). When Find fails to unlink a deleted node it resumes from the predecessor if that is still unmarked,
+ rather than from the bucket head; under RECYCLE the predecessor may have been reused, so it restarts.
+
+ NUM_BUCKETS is the number of buckets (default 10000). The bucket sentinels are linked in one pass when the table
+ is created. If the LAZY_BUCKETS flag is turned on, a bucket's sentinel is only linked by the first Add that
+ hashes to it, behind the sentinel of the bucket with the same index minus its top bit.
+
  If the PRE_ALLOCATE flag is turned on, all dynamic memory will be allocated before the sequence of operations begins.
 
+ If the RECYCLE flag is turned on (64-bit only, implies PRE_ALLOCATE), a node is returned to the free pool of the
+ thread that unlinks it and can be reused at once. Every next field then carries a 16-bit version tag in its
+ unused top bits that is bumped on each update, so a CAS against a stale view of a reused node fails.
+
+ If the CACHE flag is turned on (implies RECYCLE), the table is a bounded cache. Entries expire CACHE_TTL ms after
+ they are added (-DCACHE_TTL=ms, default 0 for never) and the table holds about CACHE_CAPACITY entries
+ (-DCACHE_CAPACITY=n, default KEYS/2). Every Add advances a CLOCK hand over a few buckets, dropping expired
+ entries and, while over capacity, entries whose reference bit was not set by a Search since the last visit.
+ The number of entries left is printed after the time.
+
+ If the KEY32 flag is turned on, keys are 32 bits wide even on 64-bit builds (KEYS must stay below 2^31-10).
+ Nodes then come from one static arena and next fields hold a 32-bit arena index and the mark bit, so a node
+ takes 8 bytes instead of 16. KEY32 cannot be combined with RECYCLE, which needs room for version tags.
+
+ AFFINITY pins the worker threads to CPUs: 1 for compact placement, 2 for scatter placement (see dispatch.h).
+ Each thread executes a contiguous range of the operation sequence and steals chunks of other ranges when done.
+
+ If the HUGE_PAGES flag is turned on, the node pools and the KEY32 arena are backed by huge pages (see hugepage.h)
+ and the backing is printed after the time.
+
+ If the PERF_COUNTERS flag is turned on, hardware counters (cycles, cache, LLC, branch and dTLB misses, stalled
+ cycles) are collected per thread around the operation sequence and printed per operation after the time.
+
  Related work:
 
  Prabhakar Misra and Mainak Chaudhuri. Performance Evaluation of Concurrent Lock-free Data Structures
@@ -65,15 +96,105 @@ policies, either expressed or implied, of Indian Institute of Technology Kanpur.
 #include"pthread.h"
 #include"assert.h"
 #include"sys/time.h"
+#include"stdint.h"
+#include"string.h"
+#include<atomic>
+#include"dispatch.h"
+#include"backoff.h"
+#include"hugepage.h"
+#include"fingerprint.h"
+#include"memstat.h"
+#include<new>
+#ifdef PERF_COUNTERS
+#include"perfctr.h"
+#endif
 
-#if __WORDSIZE == 64
-typedef unsigned long long LL;
+// Key type and the sentinel values of each key width
+
+template <int Bits> class KeyTraits;
+
+template <> class KeyTraits<64>
+{
+  public:
+    typedef unsigned long long Key;
+    static const Key TAIL=0xffffffffffffffffULL;		// Tail sentinel key
+    static const Key SENTINEL=0x8000000000000000ULL;	// Set in bucket sentinel keys
+};
+
+template <> class KeyTraits<32>
+{
+  public:
+    typedef unsigned int Key;
+    static const Key TAIL=0xffffffffu;
+    static const Key SENTINEL=0x80000000u;
+};
+
+#ifdef KEY32
+#define KEY_BITS 32
 #else
-typedef unsigned int LL;
+#define KEY_BITS __WORDSIZE
+#endif
+
+typedef KeyTraits<KEY_BITS>::Key LL;
+
+#ifdef CACHE
+#ifndef RECYCLE
+#define RECYCLE
+#endif
+#ifndef CACHE_TTL
+#define CACHE_TTL 0
+#endif
+#ifndef CACHE_CAPACITY
+#define CACHE_CAPACITY (KEYS/2)
+#endif
+#endif
+
+#ifdef RECYCLE
+#if __WORDSIZE != 64
+#error "RECYCLE needs the unused top bits of 64-bit pointers"
+#endif
+#ifdef KEY32
+#error "KEY32 leaves no room in a next field for the version tags of RECYCLE"
+#endif
+#ifndef PRE_ALLOCATE
+#define PRE_ALLOCATE
+#endif
 #endif
 
 // Number of hash table buckets
+#ifndef NUM_BUCKETS
 #define NUM_BUCKETS 10000
+#endif
+
+// Layout of a next field: reference | version tag | mark bit (bit 0)
+// Under KEY32 the reference is an arena index shifted left by one
+#ifdef KEY32
+typedef uint32_t Word;
+#else
+typedef uintptr_t Word;
+#endif
+#ifdef RECYCLE
+#define TAG_SHIFT 48
+#define TAG_MASK (((uintptr_t)0xffff)<<TAG_SHIFT)
+#define TAG_UNIT (((uintptr_t)1)<<TAG_SHIFT)
+#else
+#define TAG_MASK ((Word)0)
+#define TAG_UNIT ((Word)0)
+#endif
+#define REF_MASK (~(TAG_MASK|(uintptr_t)1))
+
+// Regular keys are below this bit, sentinel keys have it set
+#define SENTINEL_BIT (KeyTraits<KEY_BITS>::SENTINEL)
+
+#ifdef CACHE
+// Entry metadata: expiry tick in the low 31 bits, CLOCK reference bit on top
+#define META_REF 0x80000000u
+#define META_NEVER 0x7fffffffu
+#define SWEEP_STEP 1		// Buckets each Add sweeps for expired entries
+#define EVICT_STEP 2		// Entries each Add evicts while over capacity
+#define EVICT_SCAN 64		// Buckets each Add may visit to find them
+#define EVICT_CLAIM 8		// Buckets taken from the hand at once
+#endif
 
 // Supported operations
 #define ADD (0)
@@ -82,99 +203,322 @@ typedef unsigned int LL;
 
 LL items[NUM_ITEMS];		// Array of keys associated with operations
 LL op[NUM_ITEMS];               // Array of operations
-LL result[NUM_ITEMS];		// Array of outcomes
+LL result[NUM_ITEMS] __attribute__((aligned (64)));	// Array of outcomes
+
+#ifdef KEY32
+#define NODE_ALIGN 8
+#else
+#define NODE_ALIGN 16
+#endif
+
+class __attribute__((aligned (NODE_ALIGN))) Node;	// The generic node class
+
+#ifdef KEY32
+// Every node lives in this arena; index 0 is never handed out and stands for NULL
+// (it decodes to the unused first slot, only the tail ever points there)
+// A thread carves ARENA_CHUNK nodes at a time. Every add takes at most one
+// node, so NUM_ITEMS nodes plus the sentinels and a partly used chunk for each
+// worker and the main thread always suffice. The pools of PRE_ALLOCATE carve
+// on demand too: reserving each thread's share up front would leave nothing
+// for the adds a thread steals from the others.
 
-class __attribute__((aligned (16))) Node;	// The generic node class
+#define ARENA_CHUNK 64
+#define ARENA_NODES (NUM_BUCKETS+2+NUM_ITEMS+(NUM_THREADS+1)*ARENA_CHUNK)
+#define NODE_BYTES 8
+
+char arena[(uint64_t)ARENA_NODES*NODE_BYTES] __attribute__((aligned (64)));
+std::atomic<uint32_t> arenaTop(1);	// Next free arena index
+__thread uint32_t arenaNext, arenaEnd;	// Chunk carved by the calling thread
+
+static_assert((uint64_t)ARENA_NODES < 0x80000000ULL, "arena indices must fit in 31 bits");
+
+// The index goes in bits 1-31, so the byte offset is index*NODE_BYTES = value*4
+
+inline Word Encode(Node* n)
+{
+  return n==NULL ? 0 : (Word)(((char*)n-arena)/(NODE_BYTES/2));
+}
+
+inline Node* Decode(Word v)
+{
+  return (Node*)(arena+(uint64_t)(v&~(Word)1)*(NODE_BYTES/2));
+}
+#else
+inline Word Encode(Node* n)
+{
+  return (Word)n;
+}
+
+inline Node* Decode(Word v)
+{
+  return (Node*)(v&REF_MASK);
+}
+#endif
 
 class AtomicReference
 {
   public:
-    LL reference;
+    std::atomic<Word> reference;
 
     // Create a next field from a reference and mark bit
     AtomicReference(Node* ref, bool mark)
     {
-      reference=(LL)(ref)|mark;
+      reference.store(Encode(ref)|mark, std::memory_order_relaxed);
     }
 
     AtomicReference()
     {
-      reference=0;
+      reference.store(0, std::memory_order_relaxed);
+    }
+
+    bool CompareAndSet(Word expected, Node* newRef, bool newMark);
+    bool WeakCompareAndSet(Word expected, Node* newRef, bool newMark);
+    Word Load(std::memory_order order=std::memory_order_acquire);
+    Node* Get(bool* marked, std::memory_order order=std::memory_order_acquire);
+    void Set(Node* newRef, bool newMark, std::memory_order order=std::memory_order_release);
+    Node* GetReference(std::memory_order order=std::memory_order_acquire);
+
+    // Decode a next field value as returned by Load
+
+    static Node* Ref(Word value)
+    {
+      return Decode(value);
+    }
+
+    static bool Mark(Word value)
+    {
+      return value&1;
     }
 
-    bool CompareAndSet(Node* expectedRef, Node* newRef, bool oldMark, bool newMark);
-    Node* Get(bool* marked);
-    void Set(Node* newRef, bool newMark);
-    Node* GetReference();
+    // The value that replaces old: the version tag moves on by one
+
+    static Word Next(Word old, Node* newRef, bool newMark)
+    {
+      return Encode(newRef)|newMark|(((old&TAG_MASK)+TAG_UNIT)&TAG_MASK);
+    }
 };
 
 class LockFreeList;
 
 // Definition of generic node class
 
-class __attribute__((aligned (16))) Node
+class __attribute__((aligned (NODE_ALIGN))) Node
 {
   public:
     LL key;
     AtomicReference next;
+#ifdef CACHE
+    std::atomic<unsigned> meta;	// Expiry tick and reference bit
+#endif
 
     Node(LL k)
     {
       key=k;
+#ifdef CACHE
+      meta.store(META_NEVER, std::memory_order_relaxed);
+#endif
     }
-};
 
-// CompareAndSet wrapper
+    // A reused node gets a new key while stale readers may still look at it;
+    // they discard what they read once validation fails
 
-bool
-AtomicReference::CompareAndSet(Node* expectedRef, Node* newRef, bool oldMark, bool newMark)
-{
-  LL oldVal = (LL)expectedRef|oldMark;
-  LL newVal = (LL)newRef|newMark;
-  LL oldValOut;
-  bool result;
-
-#if __WORDSIZE == 64
-  asm(
-                "lock cmpxchgq %4, %1 \n setzb %0"
-                :"=qm"(result),  "+m" (reference), "=a" (oldValOut)
-                :"a" (oldVal),  "r" (newVal)
-                :
-        );
+    LL Key()
+    {
+#ifdef RECYCLE
+      return __atomic_load_n(&key, __ATOMIC_RELAXED);
 #else
-  asm(
-		"lock cmpxchgl %4, %1 \n setzb %0"
-		:"=qm"(result),  "+m" (reference), "=a" (oldValOut)
-		:"a" (oldVal),  "r" (newVal)
-		: 
-	);
+      return key;
 #endif
+    }
 
-  return result;
+    void SetKey(LL k)
+    {
+#ifdef RECYCLE
+      __atomic_store_n(&key, k, __ATOMIC_RELAXED);
+#else
+      key=k;
+#endif
+    }
+
+#ifdef KEY32
+    static void* operator new(size_t)
+    {
+      if (arenaNext==arenaEnd) {
+         arenaNext=arenaTop.fetch_add(ARENA_CHUNK, std::memory_order_relaxed);
+         if (arenaNext >= ARENA_NODES) {
+            printf("Node arena is exhausted.\nAborting...\n");
+            exit(1);
+         }
+         arenaEnd=arenaNext+ARENA_CHUNK < ARENA_NODES ? arenaNext+ARENA_CHUNK : ARENA_NODES;
+      }
+      MemCarve(NODE_BYTES);
+      return arena+(uint64_t)(arenaNext++)*NODE_BYTES;
+    }
+
+    static void operator delete(void*)
+    {
+    }
+#else
+    // Counted in the memory statistics; pool slabs are counted as a whole
+
+    static void* operator new(size_t bytes) { MemAlloc(bytes); return ::operator new(bytes); }
+    static void* operator new(size_t bytes, void* p) { return p; }
+    static void operator delete(void* p, size_t bytes) { MemFree(bytes); ::operator delete(p); }
+#endif
+};
+
+#ifdef KEY32
+static_assert(sizeof(Node) == NODE_BYTES, "a KEY32 node is a 32-bit key and a 32-bit next field");
+#endif
+
+// CompareAndSet wrappers
+// expected is a value previously returned by Load, tag included
+// The strong form is for one-shot attempts, the weak form for retry loops
+// A successful CAS publishes the new value with release ordering
+
+bool
+AtomicReference::CompareAndSet(Word expected, Node* newRef, bool newMark)
+{
+  return reference.compare_exchange_strong(expected, Next(expected, newRef, newMark), std::memory_order_release, std::memory_order_relaxed);
+}
+
+bool
+AtomicReference::WeakCompareAndSet(Word expected, Node* newRef, bool newMark)
+{
+  return reference.compare_exchange_weak(expected, Next(expected, newRef, newMark), std::memory_order_release, std::memory_order_relaxed);
+}
+
+Word
+AtomicReference::Load(std::memory_order order)
+{
+  return reference.load(order);
 }
 
 // Extract the reference and mark bit from a next field
+// Acquire loads pair with the release CAS that published the node
 
 Node*
-AtomicReference::Get(bool* marked)
+AtomicReference::Get(bool* marked, std::memory_order order)
 {
-  *marked=reference%2;
-  return (Node*)((reference>>1)<<1);
+  Word r=reference.load(order);
+  *marked=Mark(r);
+  return Ref(r);
 }
 
+// Only used while the node is private to the calling thread
+// The tag still moves on, since a reused node may be seen by stale readers
+
 void 
-AtomicReference::Set(Node* newRef, bool newMark)
+AtomicReference::Set(Node* newRef, bool newMark, std::memory_order order)
 {
-  reference=(LL)newRef|newMark;
+  reference.store(Next(reference.load(std::memory_order_relaxed), newRef, newMark), order);
 }
 
 // Extract the reference from a next field
 
 Node*
-AtomicReference::GetReference()
+AtomicReference::GetReference(std::memory_order order)
+{
+  return Ref(reference.load(order));
+}
+
+#ifdef CACHE
+std::atomic<long> cacheSize;	// Entries in the table, expired ones included
+struct timespec cacheStart;	// Time of tick 0
+
+// Milliseconds since the table was created
+
+unsigned Tick()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &t);
+  return (unsigned)((t.tv_sec-cacheStart.tv_sec)*1000+(t.tv_nsec-cacheStart.tv_nsec)/1000000);
+}
+
+unsigned Expiry(unsigned now)
+{
+  if (CACHE_TTL == 0 || now+CACHE_TTL >= META_NEVER) return META_NEVER;
+  return now+CACHE_TTL;
+}
+
+bool Expired(unsigned meta, unsigned now)
+{
+  return (meta&~META_REF) <= now;
+}
+#endif
+
+#ifdef PRE_ALLOCATE
+// Per-thread free pool of nodes, padded to a cache line
+
+class __attribute__((aligned (64))) NodePool
+{
+  public:
+    Node** nodes;
+    unsigned count;		// Nodes currently in the pool
+    unsigned capacity;
+
+    // The nodes are carved from one slab, which goes on huge pages with -DHUGE_PAGES
+    // Under KEY32 the pool starts empty and Get carves from the static arena
+
+    void Init(unsigned n)
+    {
+      nodes=new Node*[n];
+      assert(nodes != NULL);
+#ifdef KEY32
+      count=0;
+#else
+      Node* slab=(Node*)HugeAlloc((size_t)n*sizeof(Node));
+      MemReserve((size_t)n*sizeof(Node));
+      for (count=0; count<n; count++) {
+         nodes[count]=new (&slab[count]) Node(0);
+      }
+#endif
+      capacity=n;
+    }
+
+    // Stealing can give a thread more adds than its share of the pool
+
+    Node* Get()
+    {
+      if (count>0) {
+#ifndef KEY32
+         MemCarve(sizeof(Node));
+#endif
+         return nodes[--count];
+      }
+      return new Node(0);
+    }
+
+    void Put(Node* n)
+    {
+#ifndef KEY32
+      MemCarve(-(long)sizeof(Node));
+#endif
+      if (count==capacity) {
+         Node** bigger=new Node*[2*capacity];
+         for (unsigned k=0; k<count; k++) bigger[k]=nodes[k];
+         delete[] nodes;
+         nodes=bigger;
+         capacity*=2;
+      }
+      nodes[count++]=n;
+    }
+};
+
+NodePool pool[NUM_THREADS];
+
+#ifdef RECYCLE
+__thread NodePool* myPool;	// Pool of the calling thread
+
+// Called by the thread whose CAS unlinked n
+
+inline void Recycle(Node* n)
 {
-  return (Node*)((reference>>1)<<1);
+  MemReclaim(sizeof(Node));
+  myPool->Put(n);
 }
+#endif
+#endif
 
 // Window of node containing a particular key
 
@@ -183,11 +527,15 @@ class Window
   public:
     Node* pred;			// Predecessor of node holding the key being searched
     Node* curr;			// The node holding the key being searched (if present)
+    Word predNext;		// pred->next as read, pointing to curr
+    Word currNext;		// curr->next as read, unmarked
 
-    Window(Node* myPred, Node* myCurr)
+    Window(Node* myPred, Node* myCurr, Word myPredNext, Word myCurrNext)
     {
       pred=myPred;
       curr=myCurr;
+      predNext=myPredNext;
+      currNext=myCurrNext;
     }
 };
 
@@ -199,62 +547,99 @@ Find(Node* head, LL key)
 {
   Node* pred;
   Node* curr;
-  Node* succ;
-  bool marked[]={false};
-  bool snip;
+  Word predNext;
+  Word currNext;
+  LL currKey;
 
   retry: 
   while(true) {
      pred=head;
-     curr=pred->next.GetReference();
+     predNext=pred->next.Load();
      while(true) {
-        succ=curr->next.Get(marked);
-        while(marked[0]) {
-           snip=pred->next.CompareAndSet(curr, succ, false, false);
-           if(!snip) goto retry;
-	   curr=succ;
-	   succ=curr->next.Get(marked);
-	}
-	if (curr->key >= key) {
-           Window* w=new Window(pred, curr);
-	   return *w;
+        curr=AtomicReference::Ref(predNext);
+        currNext=curr->next.Load();
+        currKey=curr->Key();
+#ifdef RECYCLE
+        // If pred->next is unchanged, curr was not unlinked and reused
+        // while its fields were read
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (pred->next.Load(std::memory_order_relaxed) != predNext) goto retry;
+#endif
+        if (AtomicReference::Mark(currNext)) {
+           if (!pred->next.CompareAndSet(predNext, AtomicReference::Ref(currNext), false)) {
+              Backoff();
+#ifdef RECYCLE
+              goto retry;
+#else
+              // Resume from pred unless it was deleted meanwhile
+              predNext=pred->next.Load();
+              if (AtomicReference::Mark(predNext)) goto retry;
+              continue;
+#endif
+           }
+           predNext=AtomicReference::Next(predNext, AtomicReference::Ref(currNext), false);
+#ifdef RECYCLE
+           Recycle(curr);
+#endif
+           continue;
+        }
+	if (currKey >= key) {
+	   return Window(pred, curr, predNext, currNext);
         }
         pred=curr;
-        curr=succ;
+        predNext=currNext;
      }
   }
 }
 
 // Lock-free linked list
+// The filter is a Bloom word over every key ever added to the bucket. Add sets
+// its bits before linking the node and Delete leaves them, so Search can
+// reject a key whose bits are clear without walking the chain. The word is
+// never rebuilt: a concurrent Add may have set bits for a node it has not
+// linked yet. Under add/delete churn it fills up and the early rejection
+// stops working.
 
 class LockFreeList
 {
   public:
     Node* head;		// Head sentinel
     Node* tail;		// Tail sentinel
+    std::atomic<uint64_t> filter;	// Superset of the fingerprints of the keys
 
     bool Add(Node*);
     bool Add(LL, Node*);
     bool Search(LL);
     bool Delete(LL);
+    bool Remove(Window&);
+#ifdef CACHE
+    int Sweep(bool);
+#endif
 
     LockFreeList()
     {
       head=new Node(0);
-#if __WORDSIZE == 64
-      tail=new Node((LL)0xffffffffffffffff);
-#else
-      tail=new Node((LL)0xffffffff);
-#endif
-      head->next.Set(tail, false);
-      tail->next.Set(NULL, false);
+      tail=new Node(KeyTraits<KEY_BITS>::TAIL);
+      head->next.Set(tail, false, std::memory_order_relaxed);
+      tail->next.Set(NULL, false, std::memory_order_relaxed);
+      filter.store(0, std::memory_order_relaxed);
     }
 
     LockFreeList(LL key)
     {
       head=new Node(key);
       tail=NULL;
-      head->next.Set(NULL, false);
+      head->next.Set(NULL, false, std::memory_order_relaxed);
+      filter.store(0, std::memory_order_relaxed);
+    }
+
+    // List over a sentinel that is already linked
+
+    LockFreeList(Node* sentinel)
+    {
+      head=sentinel;
+      tail=NULL;
+      filter.store(0, std::memory_order_relaxed);
     }
 };
 
@@ -266,11 +651,15 @@ LockFreeList::Add(Node* pointer)
      Window w=Find(head, key);
      Node* pred=w.pred;
      Node* curr = w.curr;
-     if (curr->key==key) return false;
+     if (curr->Key()==key) return false;
      else{
-        pointer->next.Set(curr, false);
-        if (pred->next.CompareAndSet(curr, pointer, false, false))
+        // Not yet reachable, the CAS below publishes it
+        pointer->next.Set(curr, false, std::memory_order_relaxed);
+        if (pred->next.WeakCompareAndSet(w.predNext, pointer, false)) {
+	   MemKeys(1);
 	   return true;
+        }
+        Backoff();
      }
   }
 }
@@ -278,59 +667,172 @@ LockFreeList::Add(Node* pointer)
 bool
 LockFreeList::Add(LL key, Node *n)
 {
+   // Set before linking, or a Search after the link could miss the key
+   uint64_t fp=Fingerprint(key);
+   if ((filter.load(std::memory_order_relaxed)&fp) != fp)
+      filter.fetch_or(fp, std::memory_order_acq_rel);
    while (true) {
       Window w=Find(head, key);
       Node* pred=w.pred;
       Node* curr = w.curr;
-      if (curr->key==key) return false;
+      if (curr->Key()==key) {
+#ifdef CACHE
+         // An expired entry counts as absent; remove it and insert afresh
+         if (Expired(curr->meta.load(std::memory_order_relaxed), Tick())) {
+            Remove(w);
+            continue;
+         }
+#endif
+#ifndef PRE_ALLOCATE
+         // A node left over from a failed CAS is never freed
+         if (n!=NULL) MemRetire(sizeof(Node));
+#endif
+         return false;
+      }
       else{
 #ifdef PRE_ALLOCATE
-         n->key = key;
-         n->next.Set(curr, false);
-         if (pred->next.CompareAndSet(curr, n, false, false))
+         n->SetKey(key);
+#ifdef CACHE
+         n->meta.store(Expiry(Tick()), std::memory_order_relaxed);
+#endif
+         n->next.Set(curr, false, std::memory_order_relaxed);
+         if (pred->next.WeakCompareAndSet(w.predNext, n, false)) {
+#ifdef CACHE
+            cacheSize.fetch_add(1, std::memory_order_relaxed);
+#endif
+            MemKeys(1);
+            BackoffDone();
             return true;
+         }
 #else
-         Node* pointer=new Node(key);
-         pointer->next.Set(curr, false);
-         if (pred->next.CompareAndSet(curr, pointer, false, false))
+         // A node left over from a failed CAS is reused on the next attempt
+         if (n==NULL) n=new Node(key);
+         n->next.Set(curr, false, std::memory_order_relaxed);
+         if (pred->next.WeakCompareAndSet(w.predNext, n, false)) {
+            MemKeys(1);
+            BackoffDone();
 	    return true;
+         }
 #endif
+         Backoff();
       }
    }
 }
 
+// Wait-free search
+// Skip the head, whose sentinel key is larger than any regular key, and
+// report the key only if its node is not logically deleted
+
 bool 
 LockFreeList::Search(LL key)
 {
-  bool marked;
-  Node* curr = head;
+  uint64_t fp=Fingerprint(key);
+  if ((filter.load(std::memory_order_acquire)&fp) != fp) return false;
+#ifdef RECYCLE
+  // Nodes can be reused under a plain traversal, so validate through Find
+  Window w=Find(head, key);
+  if (w.curr->Key() != key) return false;
+#ifdef CACHE
+  // A hit gives the entry a second chance at the next CLOCK visit
+  unsigned meta=w.curr->meta.load(std::memory_order_relaxed);
+  if (Expired(meta, Tick())) return false;
+  if (!(meta&META_REF)) w.curr->meta.fetch_or(META_REF, std::memory_order_relaxed);
+#endif
+  return true;
+#else
+  bool marked=false;
+  Node* curr = head->next.GetReference();
   while (curr->key<key) {
      curr=curr->next.GetReference();
-     Node* succ = curr->next.Get(&marked);
   }
-  return((curr->key == key) && marked);
+  if (curr->key != key) return false;
+  curr->next.Get(&marked);
+  return !marked;
+#endif
 }
    
+// Logically delete w.curr by marking its next field, then try to unlink it
+// Returns false if curr->next changed since Find read it
+
+bool
+LockFreeList::Remove(Window& w)
+{
+  Node* succ = AtomicReference::Ref(w.currNext);
+  if (!w.curr->next.WeakCompareAndSet(w.currNext, succ, true)) return false;
+#ifdef CACHE
+  cacheSize.fetch_sub(1, std::memory_order_relaxed);
+#endif
+  // Without RECYCLE a removed node is never freed
+  MemKeys(-1);
+  MemRetire(sizeof(Node));
+  if (w.pred->next.CompareAndSet(w.predNext, succ, false)) {
+#ifdef RECYCLE
+     Recycle(w.curr);
+#endif
+  }
+  return true;
+}
+
+// In cache mode an expired entry is removed but reported as absent
+
 bool
 LockFreeList::Delete(LL key)
 {
-  bool snip;
   while (true) {
      Window w=Find(head, key);
      Node* curr=w.curr;
-     Node* pred=w.pred;
-     if (curr->key!=key) {
+     if (curr->Key()!=key) {
         return false;
      }
      else{
-        Node* succ = curr->next.GetReference();
-        snip=curr->next.CompareAndSet(succ, succ, false, true);
-	if (!snip) continue;
-	pred->next.CompareAndSet(curr, succ, false, false);
-	return true;
+#ifdef CACHE
+        bool live=!Expired(curr->meta.load(std::memory_order_relaxed), Tick());
+#else
+        bool live=true;
+#endif
+	if (!Remove(w)) {
+	   Backoff();
+	   continue;
+	}
+	BackoffDone();
+	return live;
+     }
+  }
+}
+
+#ifdef CACHE
+// One CLOCK visit of the bucket
+// Walks the regular keys of the bucket up to the next sentinel. Expired entries
+// are dropped, referenced entries get a second chance, and with evict set
+// unreferenced entries are dropped while the table is over capacity.
+// Returns the number of entries dropped
+
+int
+LockFreeList::Sweep(bool evict)
+{
+  int removed=0;
+  unsigned now=Tick();
+  LL key=0;
+  if (filter.load(std::memory_order_acquire) == 0) return 0;	// Bucket never used
+  // Quick look for an empty bucket; a stale answer only skips or repeats work
+  if (head->next.GetReference()->Key()&SENTINEL_BIT) return 0;
+  while (true) {
+     Window w=Find(head, key);
+     LL currKey=w.curr->Key();
+     if (currKey&SENTINEL_BIT) return removed;
+     unsigned meta=w.curr->meta.load(std::memory_order_relaxed);
+     if (Expired(meta, now) ||
+         (evict && !(meta&META_REF) && cacheSize.load(std::memory_order_relaxed) > CACHE_CAPACITY)) {
+        if (!Remove(w)) continue;
+        removed++;
+     }
+     else if (evict && (meta&META_REF)) {
+        w.curr->meta.fetch_and(~META_REF, std::memory_order_relaxed);
      }
+     key=currKey+1;
   }
 }
+#endif
 
 // Lock-free hash table
 // Each bucket is a lock-free linked list
@@ -343,11 +845,7 @@ class LockFreeHashTable
 
     LL MakeSentinelKey(LL x)
     {
-#if __WORDSIZE == 64
-       return (LL)(0x8000000000000000|x);
-#else
-       return (LL)(0x80000000|x);
-#endif
+       return SENTINEL_BIT|x;
     }
 
     // Modulo hash function
@@ -356,43 +854,172 @@ class LockFreeHashTable
     {
       return key%NUM_BUCKETS;
     }
+
+    // The bucket whose sentinel is linked in front of bucket b's: b with its
+    // top bit cleared, so initialization recurses at most log2(b) times
+
+    LL Parent(LL b)
+    {
+      LL p=b;
+      while (p&(p-1)) p&=p-1;
+      return b^p;
+    }
+
+#ifdef LAZY_BUCKETS
+    LockFreeList* Initialize(LL b);
+#endif
+
+    // Bucket b, for an operation that adds to it
+
+    LockFreeList* Bucket(LL b)
+    {
+#ifdef LAZY_BUCKETS
+      LockFreeList* l=__atomic_load_n(&buckets[b], __ATOMIC_ACQUIRE);
+      return l!=NULL ? l : Initialize(b);
+#else
+      return buckets[b];
+#endif
+    }
+
+    // Bucket b, or NULL if it was never touched
+
+    LockFreeList* Existing(LL b)
+    {
+#ifdef LAZY_BUCKETS
+      return __atomic_load_n(&buckets[b], __ATOMIC_ACQUIRE);
+#else
+      return buckets[b];
+#endif
+    }
     
   public:
     
     LockFreeList* buckets[NUM_BUCKETS];
+#ifdef CACHE
+    std::atomic<unsigned> hand;		// Next bucket for the CLOCK sweep
+    void Maintain();
+#endif
 
     bool Add(LL, Node*);
     bool Delete(LL);
     bool Search(LL);
 
     // Initialize the hash table to hold the list of bucket heads
+    // Sentinel keys grow with the bucket index, so the sentinels are linked
+    // in one pass in index order; under LAZY_BUCKETS only bucket 0 is set up
 
     LockFreeHashTable()
     {
+      MemAlloc(sizeof(LockFreeHashTable));
+#ifdef KEY32
+      MemReserve(sizeof(arena));
+#endif
       buckets[0]=new LockFreeList();
+      MemAlloc(sizeof(LockFreeList));
       int i;
+#ifdef LAZY_BUCKETS
+      for(i=1;i<NUM_BUCKETS;i++){
+        buckets[i]=NULL;
+      }
+#else
+      Node* prev=buckets[0]->head;
       for(i=1;i<NUM_BUCKETS;i++){
         buckets[i]=new LockFreeList(MakeSentinelKey(i));
-        buckets[0]->Add(buckets[i]->head);
+        MemAlloc(sizeof(LockFreeList));
+        prev->next.Set(buckets[i]->head, false, std::memory_order_relaxed);
+        prev=buckets[i]->head;
       }
+      prev->next.Set(buckets[0]->tail, false, std::memory_order_relaxed);
+#endif
+#ifdef CACHE
+      hand.store(0);
+      cacheSize.store(0);
+      clock_gettime(CLOCK_MONOTONIC_COARSE, &cacheStart);
+#endif
     }
 
 } h;
 
+#ifdef LAZY_BUCKETS
+// Link the sentinel of bucket b behind its parent's and publish the bucket
+// Racing threads agree on the first sentinel linked; the loser of the
+// publishing CAS drops its list object, which never escaped
+
+LockFreeList*
+LockFreeHashTable::Initialize(LL b)
+{
+  LockFreeList* parent=Bucket(Parent(b));
+  LL key=MakeSentinelKey(b);
+  Node* s=new Node(key);
+  Node* head;
+  while (true) {
+     Window w=Find(parent->head, key);
+     if (w.curr->Key()==key) {
+        delete s;
+        head=w.curr;
+        break;
+     }
+     s->next.Set(w.curr, false, std::memory_order_relaxed);
+     if (w.pred->next.WeakCompareAndSet(w.predNext, s, false)) {
+        head=s;
+        break;
+     }
+  }
+  LockFreeList* mine=new LockFreeList(head);
+  LockFreeList* expected=NULL;
+  if (__atomic_compare_exchange_n(&buckets[b], &expected, mine, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+     MemAlloc(sizeof(LockFreeList));
+     return mine;
+  }
+  delete mine;
+  return expected;
+}
+#endif
+
 bool LockFreeHashTable::Add(LL k, Node *n)
 {
   LL key=k;
   LL b=Hash(key);
   assert(b<NUM_BUCKETS);
-  return buckets[b]->Add(key, n);
+#ifdef CACHE
+  bool added=Bucket(b)->Add(key, n);
+  Maintain();
+  return added;
+#else
+  return Bucket(b)->Add(key, n);
+#endif
+}
+
+#ifdef CACHE
+// Incremental upkeep, run by every Add
+// Advances the CLOCK hand over a few buckets, so no caller pays for a full sweep
+
+void LockFreeHashTable::Maintain()
+{
+  int k, j, evicted=0;
+  unsigned b;
+  LockFreeList* l;
+  for (k=0;k<SWEEP_STEP;k++)
+     if ((l=Existing(hand.fetch_add(1, std::memory_order_relaxed)%NUM_BUCKETS)) != NULL)
+        l->Sweep(false);
+  // The hand is claimed EVICT_CLAIM buckets at a time to keep it off the hot path
+  for (k=0;k<EVICT_SCAN && evicted<EVICT_STEP && cacheSize.load(std::memory_order_relaxed) > CACHE_CAPACITY;k+=EVICT_CLAIM) {
+     b=hand.fetch_add(EVICT_CLAIM, std::memory_order_relaxed);
+     for (j=0;j<EVICT_CLAIM;j++)
+        if ((l=Existing((b+j)%NUM_BUCKETS)) != NULL)
+           evicted+=l->Sweep(true);
+  }
 }
+#endif
 
 bool LockFreeHashTable::Delete(LL k)
 {
   LL key=k;
   LL b=Hash(key);
   assert(b<NUM_BUCKETS);
-  return buckets[b]->Delete(key);
+  LockFreeList* l=Existing(b);
+  if (l==NULL) return false;	// Nothing was ever added to the bucket
+  return l->Delete(key);
 }
 
 bool LockFreeHashTable::Search(LL k)
@@ -400,12 +1027,15 @@ bool LockFreeHashTable::Search(LL k)
   LL key=k;
   LL b=Hash(key);
   assert(b<NUM_BUCKETS);
-  return buckets[b]->Search(key);
+  LockFreeList* l=Existing(b);
+  if (l==NULL) return false;	// Nothing was ever added to the bucket
+  return l->Search(key);
 }
 
-#ifdef PRE_ALLOCATE
-Node ***freelist;                       // Per-thread free pool
-unsigned indexPointer[NUM_THREADS];     // Index into free pool
+Dispatcher* dispatcher;
+
+#ifdef PERF_COUNTERS
+PerfTotals totals;
 #endif
 
 // The worker thread function
@@ -414,15 +1044,29 @@ unsigned indexPointer[NUM_THREADS];     // Index into free pool
 void* Thread (void* t)
 {  
   unsigned int tid=(unsigned long) t;
-  int i;
-  for (i=tid;i<NUM_ITEMS;i+=NUM_THREADS) {
+  long i, begin, end;
+  dispatcher->Pin(tid);
+#ifdef RECYCLE
+  myPool=&pool[tid];
+#endif
+#ifdef PERF_COUNTERS
+  PerfGroup counters;
+  counters.Open();
+  counters.Start();
+#endif
+  while (dispatcher->Next(tid, &begin, &end)) {
+   for (i=begin;i<end;i++) {
      // Grab the operations and execute
      unsigned int item = items[i];
      switch(op[i]){
        case ADD:
 #ifdef PRE_ALLOCATE
-         result[i]=10+h.Add(item, freelist[tid][indexPointer[tid]]);
-         indexPointer[tid]++;
+         {
+            // A node that was not linked goes straight back to the pool
+            Node* n=pool[tid].Get();
+            result[i]=10+h.Add(item, n);
+            if (result[i]==10) pool[tid].Put(n);
+         }
 #else
          result[i]=10+h.Add(item, NULL);
 #endif
@@ -434,7 +1078,13 @@ void* Thread (void* t)
          result[i]=30+h.Search(item);
          break;
      }
+   }
   }
+#ifdef PERF_COUNTERS
+  counters.Stop();
+  counters.Accumulate(&totals);
+#endif
+  return NULL;
 }
 
 // For debugging
@@ -443,12 +1093,9 @@ void PrintList()
 {
   LockFreeList* l=h.buckets[0];
   Node* p=l->head;
-  while (p!=NULL) {
-#if __WORDSIZE == 64
-    printf("%#llx\n",p->key);
-#else
-    printf("%#x\n",p->key);
-#endif
+  while (true) {
+    printf("%#llx\n",(unsigned long long)p->key);
+    if (p->key==KeyTraits<KEY_BITS>::TAIL) break;
     p=p->next.GetReference();
   }
 }
@@ -480,24 +1127,30 @@ int main(int argc, char** argv)
 
   int rc;
   long t;
-  int i, j;
+  int i;
 
 #ifdef PRE_ALLOCATE
   // Allocate free pool
 
-  freelist = new Node**[NUM_THREADS];
-  assert(freelist != NULL);
   for (i=0; i<NUM_THREADS; i++) {
-     indexPointer[i] = 0;
-     freelist[i] = new Node*[(NUM_ITEMS*adds)/(100*NUM_THREADS)+1];
-     assert(freelist[i] != NULL);
-     for (j=0; j<(NUM_ITEMS*adds)/(100*NUM_THREADS)+1; j++) {
-        freelist[i][j] = new Node(0);
-        assert(freelist[i][j] != NULL);
-     }
+#ifdef RECYCLE
+     // At most KEYS nodes are live at a time, the pools refill from deletes
+     pool[i].Init(KEYS/NUM_THREADS+1);
+#else
+     pool[i].Init((NUM_ITEMS*adds)/(100*NUM_THREADS)+1);
+#endif
   }
 #endif
 
+#ifdef KEY32
+  HugeAdvise(arena, sizeof(arena));
+#ifdef PRE_ALLOCATE
+  // Fault in the untouched part of the arena now rather than during the run
+  uint64_t carved=(uint64_t)arenaTop.load()*NODE_BYTES;
+  memset(arena+carved, 0, sizeof(arena)-carved);
+#endif
+#endif
+
   srand(0);
 
   // Populate key array
@@ -516,6 +1169,9 @@ int main(int argc, char** argv)
   for(;i<NUM_ITEMS;i++){
     op[i]=SEARCH;
   }
+  ShuffleOps(op, NUM_ITEMS);
+
+  dispatcher = new Dispatcher(NUM_ITEMS, NUM_THREADS, AFFINITY);
   
   struct timeval tv0,tv1;
   struct timezone tz0,tz1;
@@ -541,5 +1197,13 @@ int main(int argc, char** argv)
   // Print time in ms
 
   printf("%lf\n",((float)((tv1.tv_sec-tv0.tv_sec)*1000000+(tv1.tv_usec-tv0.tv_usec)))/1000.0);
+#ifdef PERF_COUNTERS
+  totals.Report(NUM_ITEMS);
+#endif
+#ifdef CACHE
+  printf("entries %ld\n", cacheSize.load());
+#endif
+  HugeReport();
+  MemReport();
   return 0;
 }
@@ -0,0 +1,580 @@
+/**********************************************************************************
+
+ Lock-free hash table in a POSIX shared-memory segment
+
+ The table of LockFreeHashTablePOSIX.cpp laid out in one shm_open + mmap segment, so that several processes
+ can attach to the same copy and run Add, Delete and Search on it concurrently. Each process may map the
+ segment at a different address, so next fields hold offsets from the start of the segment instead of Node
+ pointers, and nodes come from an allocator inside the segment.
+
+ A node unlinked from the table is freed at once and reused by later Adds of any process, through a stack of
+ freed nodes in the segment. As under RECYCLE in LockFreeHashTablePOSIX.cpp, every next field carries a 16-bit
+ version tag in its unused top bits that is bumped on each update, so a CAS against a stale view of a reused
+ node fails, and Find checks that pred->next is unchanged after reading curr. An Add that finds the segment
+ full of live nodes returns false.
+
+ Inputs: Percentage of add and delete operations (e.g., 30 50 for 30% add and 50% delete), and -f to replace
+         a segment of the same name left behind by an earlier run
+ Output: Prints the total time (in milliseconds) to execute the the sequence of operations
+
+ Compilation flags: -O3 -pthread -DNUM_ITEMS=num_ops -DNUM_PROCS=num_processes -DKEYS=num_keys
+
+ Optional compilation flags: -DAFFINITY=1|2 -DHUGE_PAGES
+
+ NUM_PROCS is the number of worker processes. The parent creates the segment and forks them; each worker
+ attaches to the segment by name, which maps it at a new address, and claims chunks of the operation
+ sequence from a cursor in the segment. KEYS and AFFINITY are as in LockFreeHashTablePOSIX.cpp. HUGE_PAGES asks
+ for transparent huge pages on the segment, which takes effect if shmem_enabled allows it.
+
+ Other programs can attach to a live segment with AttachSegment(SEGMENT_NAME) and leave it with DetachSegment().
+
+***************************************************************************************/
+
+#include"stdio.h"
+#include"stdlib.h"
+#include"time.h"
+#include"assert.h"
+#include"stdint.h"
+#include"string.h"
+#include"errno.h"
+#include"fcntl.h"
+#include"unistd.h"
+#include"sys/mman.h"
+#include"sys/stat.h"
+#include"sys/wait.h"
+#include"sys/time.h"
+#include"dispatch.h"
+#include"hugepage.h"
+#include"backoff.h"
+#include<atomic>
+
+#if __WORDSIZE != 64
+#error "the shared-memory table needs 64-bit offsets"
+#endif
+
+typedef unsigned long long LL;
+
+// Number of hash table buckets
+#define NUM_BUCKETS 10000
+
+// Supported operations
+#define ADD (0)
+#define DELETE (1)
+#define SEARCH (2)
+
+// Name of the segment and the value that marks it as initialized
+#define SEGMENT_NAME "/lockfreehashtable"
+#define SEGMENT_MAGIC 0x6c6668742d73686dULL
+
+// Nodes a process takes from the segment allocator at once
+#define NODE_BATCH 64
+
+LL items[NUM_ITEMS];		// Array of keys associated with operations
+LL op[NUM_ITEMS];               // Array of operations
+
+// Position of an object in the segment; 0 is the segment header, so it doubles as null
+
+typedef uint64_t Offset;
+
+// Layout of a next field: offset | version tag | mark bit (bit 0)
+// Every update bumps the tag, which lives in bits no offset reaches
+#define TAG_SHIFT 48
+#define TAG_MASK (((uint64_t)0xffff)<<TAG_SHIFT)
+#define TAG_UNIT (((uint64_t)1)<<TAG_SHIFT)
+#define REF_MASK (~(TAG_MASK|(uint64_t)1))
+
+char* segment;			// Start of the segment in this process
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "cross-process atomics must be lock-free");
+
+class __attribute__((aligned (16))) Node;
+
+class AtomicReference
+{
+  public:
+    std::atomic<uint64_t> reference;	// Offset of the successor | version tag | mark bit
+
+    bool CompareAndSet(uint64_t expected, Offset newRef, bool newMark);
+    bool WeakCompareAndSet(uint64_t expected, Offset newRef, bool newMark);
+    uint64_t Load(std::memory_order order=std::memory_order_acquire);
+    void Set(Offset newRef, bool newMark, std::memory_order order=std::memory_order_release);
+
+    // Decode a next field value as returned by Load
+
+    static Offset Ref(uint64_t value)
+    {
+      return value&REF_MASK;
+    }
+
+    static bool Mark(uint64_t value)
+    {
+      return value&1;
+    }
+
+    // The value that replaces old: the version tag moves on by one
+
+    static uint64_t Next(uint64_t old, Offset newRef, bool newMark)
+    {
+      return newRef|newMark|(((old&TAG_MASK)+TAG_UNIT)&TAG_MASK);
+    }
+};
+
+class __attribute__((aligned (16))) Node
+{
+  public:
+    LL key;
+    AtomicReference next;
+
+    // A reused node gets a new key while stale readers may still look at it;
+    // they discard what they read once validation fails
+
+    LL Key()
+    {
+      return __atomic_load_n(&key, __ATOMIC_RELAXED);
+    }
+
+    void SetKey(LL k)
+    {
+      __atomic_store_n(&key, k, __ATOMIC_RELAXED);
+    }
+};
+
+// Translate between offsets and addresses in this process
+
+inline Node* At(Offset o)
+{
+  return (Node*)(segment+o);
+}
+
+bool
+AtomicReference::CompareAndSet(uint64_t expected, Offset newRef, bool newMark)
+{
+  return reference.compare_exchange_strong(expected, Next(expected, newRef, newMark), std::memory_order_release, std::memory_order_relaxed);
+}
+
+bool
+AtomicReference::WeakCompareAndSet(uint64_t expected, Offset newRef, bool newMark)
+{
+  return reference.compare_exchange_weak(expected, Next(expected, newRef, newMark), std::memory_order_release, std::memory_order_relaxed);
+}
+
+uint64_t
+AtomicReference::Load(std::memory_order order)
+{
+  return reference.load(order);
+}
+
+// Only used while the node is private to the calling process
+// The tag still moves on, since a reused node may be seen by stale readers
+
+void
+AtomicReference::Set(Offset newRef, bool newMark, std::memory_order order)
+{
+  reference.store(Next(reference.load(std::memory_order_relaxed), newRef, newMark), order);
+}
+
+// Start of the segment
+// magic is written last, once the sentinel list is in place
+
+class SegmentHeader
+{
+  public:
+    std::atomic<uint64_t> magic;
+    uint64_t size;			// Bytes in the segment
+    std::atomic<uint64_t> top;		// Bump pointer of the node allocator
+    std::atomic<uint64_t> free;		// Stack of freed nodes: offset | version tag
+    std::atomic<long> cursor;		// Next operation to hand out (benchmark)
+    Offset results;			// Array of outcomes (benchmark)
+    Offset buckets[NUM_BUCKETS];	// Head sentinel of each bucket
+};
+
+SegmentHeader* header;
+
+// Node allocator
+// Each process carves NODE_BATCH nodes at a time out of the segment and keeps
+// up to NODE_BATCH of the nodes it frees. Further freed nodes go to a stack in
+// the segment, which a process takes from before it carves a new batch.
+
+Offset batchNext, batchEnd;
+Offset spare[NODE_BATCH];	// Nodes freed by this process
+int spares;
+
+// Push a node on the stack of freed nodes
+// The stack is linked through the next fields, whose tags keep moving
+
+void
+PushFree(Offset o)
+{
+  uint64_t top=header->free.load(std::memory_order_relaxed);
+  do {
+     At(o)->next.Set(AtomicReference::Ref(top), false, std::memory_order_relaxed);
+  } while (!header->free.compare_exchange_weak(top, AtomicReference::Next(top, o, false),
+                                               std::memory_order_release, std::memory_order_relaxed));
+}
+
+// Pop a freed node, 0 if there is none
+// The tag of the top makes the CAS fail if the node was popped and pushed back meanwhile
+
+Offset
+PopFree()
+{
+  uint64_t top=header->free.load(std::memory_order_acquire);
+  while (AtomicReference::Ref(top)!=0) {
+     Offset link=AtomicReference::Ref(At(AtomicReference::Ref(top))->next.Load(std::memory_order_relaxed));
+     if (header->free.compare_exchange_weak(top, AtomicReference::Next(top, link, false),
+                                            std::memory_order_acquire, std::memory_order_acquire)) {
+        return AtomicReference::Ref(top);
+     }
+  }
+  return 0;
+}
+
+// A node holding key, or 0 if the segment is full
+
+Offset
+NewNode(LL key)
+{
+  Offset o;
+  if (spares>0) {
+     o=spare[--spares];
+  }
+  else if (batchNext!=batchEnd) {
+     o=batchNext;
+     batchNext+=sizeof(Node);
+  }
+  else if ((o=PopFree())==0) {
+     // Once the segment is carved up, top stays put
+     if (header->top.load(std::memory_order_relaxed)+NODE_BATCH*sizeof(Node) > header->size) return 0;
+     o=header->top.fetch_add(NODE_BATCH*sizeof(Node), std::memory_order_relaxed);
+     if (o+NODE_BATCH*sizeof(Node) > header->size) return 0;
+     batchNext=o+sizeof(Node);
+     batchEnd=o+NODE_BATCH*sizeof(Node);
+  }
+  At(o)->SetKey(key);
+  At(o)->next.Set(0, false, std::memory_order_relaxed);
+  return o;
+}
+
+// Called by the process whose CAS unlinked the node, or that never linked it
+
+void
+FreeNode(Offset o)
+{
+  if (spares<NODE_BATCH) spare[spares++]=o;
+  else PushFree(o);
+}
+
+// Window of node containing a particular key
+
+class Window
+{
+  public:
+    Offset pred;		// Predecessor of node holding the key being searched
+    Offset curr;		// The node holding the key being searched (if present)
+    uint64_t predNext;		// pred->next as read, pointing to curr
+    uint64_t currNext;		// curr->next as read, unmarked
+
+    Window(Offset myPred, Offset myCurr, uint64_t myPredNext, uint64_t myCurrNext)
+    {
+      pred=myPred;
+      curr=myCurr;
+      predNext=myPredNext;
+      currNext=myCurrNext;
+    }
+};
+
+// Find the window holding key
+// On the way clean up logically deleted nodes (those with set marked bit)
+
+Window
+Find(Offset head, LL key)
+{
+  Offset pred, curr;
+  uint64_t predNext, currNext;
+  LL currKey;
+
+  retry:
+  while(true) {
+     pred=head;
+     predNext=At(pred)->next.Load();
+     while(true) {
+        curr=AtomicReference::Ref(predNext);
+        currNext=At(curr)->next.Load();
+        currKey=At(curr)->Key();
+        // If pred->next is unchanged, curr was not unlinked and reused
+        // while its fields were read
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (At(pred)->next.Load(std::memory_order_relaxed) != predNext) goto retry;
+        if (AtomicReference::Mark(currNext)) {
+           if (!At(pred)->next.CompareAndSet(predNext, AtomicReference::Ref(currNext), false)) {
+              // pred may have been reused meanwhile, so start over
+              Backoff();
+              goto retry;
+           }
+           predNext=AtomicReference::Next(predNext, AtomicReference::Ref(currNext), false);
+           FreeNode(curr);
+           continue;
+        }
+        if (currKey >= key) {
+           return Window(pred, curr, predNext, currNext);
+        }
+        pred=curr;
+        predNext=currNext;
+     }
+  }
+}
+
+// Hash table operations on the attached segment
+
+LL Hash(LL key)
+{
+  return key%NUM_BUCKETS;
+}
+
+bool Add(LL key)
+{
+  Offset head=header->buckets[Hash(key)];
+  Offset n=0;
+  while (true) {
+     Window w=Find(head, key);
+     if (At(w.curr)->Key()==key) {
+        if (n!=0) FreeNode(n);	// Left over from a failed CAS
+        return false;
+     }
+     if (n==0 && (n=NewNode(key))==0) return false;	// Cannot be stored, the segment is full
+     At(n)->next.Set(w.curr, false, std::memory_order_relaxed);
+     if (At(w.pred)->next.WeakCompareAndSet(w.predNext, n, false)) {
+        BackoffDone();
+        return true;
+     }
+     Backoff();
+  }
+}
+
+bool Delete(LL key)
+{
+  Offset head=header->buckets[Hash(key)];
+  while (true) {
+     Window w=Find(head, key);
+     if (At(w.curr)->Key()!=key) return false;
+     Offset succ=AtomicReference::Ref(w.currNext);
+     if (!At(w.curr)->next.WeakCompareAndSet(w.currNext, succ, true)) {
+        Backoff();
+        continue;
+     }
+     if (At(w.pred)->next.CompareAndSet(w.predNext, succ, false)) FreeNode(w.curr);
+     BackoffDone();
+     return true;
+  }
+}
+
+// Nodes can be reused under a plain traversal, so search through Find
+
+bool Search(LL key)
+{
+  Window w=Find(header->buckets[Hash(key)], key);
+  return At(w.curr)->Key()==key;
+}
+
+// Create and initialize a segment of size bytes
+// An existing segment of the same name is only replaced if replace is set
+// The sentinels of all buckets are linked in key order in one pass
+
+SegmentHeader*
+CreateSegment(const char* name, uint64_t size, bool replace)
+{
+  if (size >= TAG_UNIT) {
+     printf("Segment offsets must fit below the version tags.\nAborting...\n");
+     exit(1);
+  }
+  if (replace) shm_unlink(name);
+  int fd=shm_open(name, O_CREAT|O_EXCL|O_RDWR, 0600);
+  if (fd<0 && errno==EEXIST) {
+     printf("Segment %s already exists.\nAborting...\n", name);
+     exit(1);
+  }
+  if (fd<0 || ftruncate(fd, size)!=0) {
+     perror("shm_open");
+     exit(1);
+  }
+  void* p=mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p==MAP_FAILED) {
+     perror("mmap");
+     exit(1);
+  }
+  HugeAdvise(p, size);
+  segment=(char*)p;
+  header=(SegmentHeader*)p;
+  header->size=size;
+  header->top.store((sizeof(SegmentHeader)+15)&~(uint64_t)15);
+  header->free.store(0);
+  header->cursor.store(0);
+  batchNext=batchEnd=0;
+  spares=0;
+
+  Offset tail=NewNode((LL)0xffffffffffffffff);
+  Offset prev=NewNode(0);
+  header->buckets[0]=prev;
+  for (int i=1;i<NUM_BUCKETS;i++) {
+     Offset s=NewNode((LL)(0x8000000000000000|i));
+     header->buckets[i]=s;
+     At(prev)->next.Set(s, false, std::memory_order_relaxed);
+     prev=s;
+  }
+  At(prev)->next.Set(tail, false, std::memory_order_relaxed);
+  header->magic.store(SEGMENT_MAGIC, std::memory_order_release);
+  return header;
+}
+
+// Map an existing segment into this process
+
+SegmentHeader*
+AttachSegment(const char* name)
+{
+  struct stat st;
+  int fd=shm_open(name, O_RDWR, 0600);
+  if (fd<0 || fstat(fd, &st)!=0) {
+     perror("shm_open");
+     exit(1);
+  }
+  void* p=mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p==MAP_FAILED) {
+     perror("mmap");
+     exit(1);
+  }
+  HugeAdvise(p, st.st_size);
+  segment=(char*)p;
+  header=(SegmentHeader*)p;
+  if (header->magic.load(std::memory_order_acquire)!=SEGMENT_MAGIC) {
+     printf("Segment %s is not initialized.\nAborting...\n", name);
+     exit(1);
+  }
+  batchNext=batchEnd=0;
+  spares=0;
+  return header;
+}
+
+// Unmap the segment from this process
+// Its spare nodes and the rest of its batch go to the stack of freed nodes,
+// so a long-lived segment does not lose them as processes come and go
+
+void
+DetachSegment()
+{
+  while (spares>0) PushFree(spare[--spares]);
+  for (; batchNext!=batchEnd; batchNext+=sizeof(Node)) PushFree(batchNext);
+  munmap(segment, header->size);
+  segment=NULL;
+  header=NULL;
+}
+
+// The worker process body
+// Claims chunks of the operation sequence from the cursor in the segment
+
+void Worker(int tid, Dispatcher* d)
+{
+  long i, begin;
+  d->Pin(tid);
+  AttachSegment(SEGMENT_NAME);
+  LL* result=(LL*)(segment+header->results);
+  while ((begin=header->cursor.fetch_add(DISPATCH_CHUNK, std::memory_order_relaxed)) < NUM_ITEMS) {
+     long end=begin+DISPATCH_CHUNK < NUM_ITEMS ? begin+DISPATCH_CHUNK : NUM_ITEMS;
+     for (i=begin;i<end;i++) {
+        switch(op[i]){
+          case ADD:
+            result[i]=10+Add(items[i]);
+            break;
+          case DELETE:
+            result[i]=20+Delete(items[i]);
+            break;
+          case SEARCH:
+            result[i]=30+Search(items[i]);
+            break;
+        }
+     }
+  }
+  DetachSegment();
+}
+
+int main(int argc, char** argv)
+{
+  bool replace=argc==4 && strcmp(argv[3], "-f")==0;
+  if (argc != 3 && !replace) {
+     printf("Need two arguments: percent add ops and percent delete ops (e.g., 30 50 for 30%% add and 50%% delete),\n"
+            "then -f to replace an existing segment.\nAborting...\n");
+     exit(1);
+  }
+
+  // Extract operations ratio
+  int adds=atoi(argv[1]);
+  int deletes=atoi(argv[2]);
+
+  if (adds+deletes > 100) {
+     printf("Sum of add and delete precentages exceeds 100.\nAborting...\n");
+     exit(1);
+  }
+
+  int i, t;
+
+  srand(0);
+
+  // Populate key array
+  for(i=0;i<NUM_ITEMS;i++){
+    items[i]=10+rand()%KEYS;		// KEYS is the number of integer keys
+  }
+
+  // Populate op array
+  for(i=0;i<(NUM_ITEMS*adds)/100;i++){
+    op[i]=ADD;
+  }
+  for(;i<(NUM_ITEMS*(adds+deletes))/100;i++){
+    op[i]=DELETE;
+  }
+  for(;i<NUM_ITEMS;i++){
+    op[i]=SEARCH;
+  }
+  ShuffleOps(op, NUM_ITEMS);
+
+  // Room for the header, the results, the sentinels and every add, plus one partial batch per process
+  uint64_t nodes=NUM_BUCKETS+1+((uint64_t)NUM_ITEMS*adds)/100+(uint64_t)(NUM_PROCS+1)*NODE_BATCH;
+  uint64_t size=sizeof(SegmentHeader)+16+(uint64_t)NUM_ITEMS*sizeof(LL)+nodes*sizeof(Node);
+  size=(size+4095)&~(uint64_t)4095;
+  CreateSegment(SEGMENT_NAME, size, replace);
+  header->results=header->top.fetch_add(((uint64_t)NUM_ITEMS*sizeof(LL)+15)&~(uint64_t)15);
+
+  Dispatcher d(NUM_ITEMS, NUM_PROCS, AFFINITY);
+
+  struct timeval tv0,tv1;
+  struct timezone tz0,tz1;
+
+  // Spawn worker processes
+
+  gettimeofday(&tv0,&tz0);
+  for(t=0;t<NUM_PROCS;t++){
+    pid_t pid=fork();
+    if (pid<0) {
+      perror("fork");
+      exit(-1);
+    }
+    if (pid==0) {
+      Worker(t, &d);
+      _exit(0);
+    }
+  }
+
+  // Wait for workers
+
+  for(t=0;t<NUM_PROCS;t++){
+    wait(NULL);
+  }
+  gettimeofday(&tv1,&tz1);
+
+  // Print time in ms
+
+  printf("%lf\n",((float)((tv1.tv_sec-tv0.tv_sec)*1000000+(tv1.tv_usec-tv0.tv_usec)))/1000.0);
+  HugeReport();
+  shm_unlink(SEGMENT_NAME);
+  return 0;
+}
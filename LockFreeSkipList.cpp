@@ -0,0 +1,471 @@
+// LockFreeSkipList.cpp
+//
+// Lock-free skip list with ordered range scans, on the Node/AtomicReference
+// mark-bit scheme of LockFreeHashTable.cpp. A node is in the set when it is
+// linked and unmarked at the bottom level; the upper levels are shortcuts.
+// Delete marks a node's next fields from the top level down, and the mark at
+// the bottom level is its linearization point. Find snips marked nodes at
+// every level, as the list version does. Search, RangeScan and Successor only
+// read and never help.
+//
+// Compile: g++ -O3 -fopenmp -DNUM_ITEMS=num_ops -DKEYS=num_keys -o LockFreeSkipList LockFreeSkipList.cpp
+// Run:     ./LockFreeSkipList <percent add ops> <percent delete ops> <num threads> [<percent range scans>]
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "time.h"
+#include "omp.h"
+#include "assert.h"
+#include "sys/time.h"
+#include "dispatch.h"
+#include "backoff.h"
+#include "memstat.h"
+#ifdef PERF_COUNTERS
+#include "perfctr.h"
+#endif
+#include <atomic>
+#include <vector>
+#include <new>
+#include <stdint.h>
+
+typedef unsigned long long LL;
+
+// Levels 0 .. MAX_LEVEL; a node reaches level l with probability 2^-l
+#define MAX_LEVEL 20
+
+// Keys a range scan covers, starting at its operation's key
+#ifndef RANGE_SPAN
+#define RANGE_SPAN 100
+#endif
+
+// Supported operations
+#define ADD (0)
+#define DELETE (1)
+#define SEARCH (2)
+#define RANGE (3)
+
+LL items[NUM_ITEMS];    // Array of keys associated with operations
+LL op[NUM_ITEMS];       // Array of operations
+LL result[NUM_ITEMS] __attribute__((aligned (64)));   // Array of outcomes
+
+class __attribute__((aligned (16))) Node;
+
+class AtomicReference {
+public:
+  std::atomic<uintptr_t> reference;
+
+  AtomicReference() {
+    reference.store(0, std::memory_order_relaxed);
+  }
+
+  // Success publishes the new value with release ordering
+  bool CompareAndSet(Node* expectedRef, Node* newRef, bool oldMark, bool newMark) {
+    uintptr_t oldVal = (uintptr_t)expectedRef | oldMark;
+    uintptr_t newVal = (uintptr_t)newRef | newMark;
+    return reference.compare_exchange_strong(oldVal, newVal,
+                                             std::memory_order_release, std::memory_order_relaxed);
+  }
+
+  // Acquire loads pair with the release CAS that published the node
+  Node* Get(bool* marked) {
+    uintptr_t r = reference.load(std::memory_order_acquire);
+    *marked = r & 1;
+    return (Node*)(r & ~(uintptr_t)1);
+  }
+
+  void Set(Node* newRef, bool newMark, std::memory_order order = std::memory_order_release) {
+    reference.store((uintptr_t)newRef | newMark, order);
+  }
+
+  Node* GetReference() {
+    return (Node*)(reference.load(std::memory_order_acquire) & ~(uintptr_t)1);
+  }
+};
+
+// A node of height topLevel + 1; next[] is sized at allocation
+class __attribute__((aligned (16))) Node {
+public:
+  LL key;
+  int topLevel;
+  AtomicReference next[1];
+
+  Node(LL k, int height) {
+    key = k;
+    topLevel = height;
+    for (int l = 1; l <= height; l++) new (&next[l]) AtomicReference();
+  }
+};
+
+inline size_t NodeSize(int height)
+{
+  return (sizeof(Node) + height * sizeof(AtomicReference) + 15) & ~(size_t)15;
+}
+
+// Per-thread bump arena for nodes of any height
+// Nodes are never freed one at a time: a thread may still be reading a node
+// that Delete unlinked
+#define ARENA_BYTES (256 * 1024)
+
+class NodeArena {
+public:
+  char* next;
+  char* end;
+
+  NodeArena() {
+    next = end = NULL;
+  }
+
+  Node* Get(LL key, int height) {
+    size_t bytes = NodeSize(height);
+    if (next + bytes > end) {
+      next = (char*)aligned_alloc(64, ARENA_BYTES);
+      assert(next != NULL);
+      end = next + ARENA_BYTES;
+      MemReserve(ARENA_BYTES);
+    }
+    MemCarve(bytes);
+    Node* n = new (next) Node(key, height);
+    next += bytes;
+    return n;
+  }
+};
+
+__thread NodeArena* myArena;
+__thread unsigned levelSeed;
+
+inline NodeArena* Arena() {
+  if (myArena == NULL) {
+    myArena = new NodeArena();
+    MemAlloc(sizeof(NodeArena));
+  }
+  return myArena;
+}
+
+// Geometric height, from a xorshift private to the thread
+inline int RandomLevel() {
+  if (levelSeed == 0) levelSeed = (unsigned)(uintptr_t)&levelSeed | 1;
+  levelSeed ^= levelSeed << 13;
+  levelSeed ^= levelSeed >> 17;
+  levelSeed ^= levelSeed << 5;
+  int level = __builtin_ctz(levelSeed | (1u << MAX_LEVEL));
+  return level;
+}
+
+class LockFreeSkipList
+{
+  private:
+    Node* head;     // Head sentinel, key 0, full height
+    Node* tail;     // Tail sentinel, key 0xffffffffffffffff
+
+    bool Find(LL key, Node** preds, Node** succs);
+    Node* Ceiling(LL key);
+
+  public:
+    LockFreeSkipList()
+    {
+      head = Arena()->Get(0, MAX_LEVEL);
+      tail = Arena()->Get((LL)0xffffffffffffffff, MAX_LEVEL);
+      for (int l = 0; l <= MAX_LEVEL; l++) {
+        head->next[l].Set(tail, false, std::memory_order_relaxed);
+        tail->next[l].Set(NULL, false, std::memory_order_relaxed);
+      }
+    }
+
+    bool Add(LL);
+    bool Delete(LL);
+    bool Search(LL);
+    long RangeScan(LL, LL, LL*, long);
+    bool Successor(LL, LL*);
+} s;
+
+// Fill preds[l] and succs[l] with the nodes around key at every level,
+// snipping marked nodes on the way; true if succs[0] holds key
+// A failed snip means pred changed, so the search restarts from the top
+bool
+LockFreeSkipList::Find(LL key, Node** preds, Node** succs)
+{
+  bool marked;
+  Node* pred;
+  Node* curr;
+  Node* succ;
+
+  retry:
+  while (true) {
+    pred = head;
+    for (int level = MAX_LEVEL; level >= 0; level--) {
+      curr = pred->next[level].GetReference();
+      while (true) {
+        succ = curr->next[level].Get(&marked);
+        while (marked) {
+          if (!pred->next[level].CompareAndSet(curr, succ, false, false)) {
+            Backoff();
+            goto retry;
+          }
+          curr = succ;
+          succ = curr->next[level].Get(&marked);
+        }
+        if (curr->key < key) {
+          pred = curr;
+          curr = succ;
+        } else {
+          break;
+        }
+      }
+      preds[level] = pred;
+      succs[level] = curr;
+    }
+    return curr->key == key;
+  }
+}
+
+// Link the bottom level first, which adds the key, then the levels above
+// An upper level whose neighbours moved is retried with a fresh Find; if the
+// node is marked meanwhile, its remaining levels are left unlinked
+bool
+LockFreeSkipList::Add(LL key)
+{
+  Node* preds[MAX_LEVEL + 1];
+  Node* succs[MAX_LEVEL + 1];
+  Node* n = NULL;
+  int topLevel = RandomLevel();
+  while (true) {
+    if (Find(key, preds, succs)) {
+      // A node left over from a failed CAS stays in the arena
+      if (n != NULL) MemRetire(NodeSize(topLevel));
+      return false;
+    }
+    if (n == NULL) n = Arena()->Get(key, topLevel);
+    for (int l = 0; l <= topLevel; l++)
+      n->next[l].Set(succs[l], false, std::memory_order_relaxed);
+    if (!preds[0]->next[0].CompareAndSet(succs[0], n, false, false)) {
+      Backoff();
+      continue;
+    }
+    BackoffDone();
+    MemKeys(1);
+    for (int l = 1; l <= topLevel; l++) {
+      while (true) {
+        if (preds[l]->next[l].CompareAndSet(succs[l], n, false, false)) break;
+        Find(key, preds, succs);
+        // Point the level at its new successor, unless Delete marked it
+        bool marked;
+        Node* old = n->next[l].Get(&marked);
+        if (marked || succs[0] != n) return true;
+        if (old != succs[l] && !n->next[l].CompareAndSet(old, succs[l], false, false))
+          return true;
+      }
+    }
+    return true;
+  }
+}
+
+// Mark the upper levels top down, then the bottom level; the thread whose
+// bottom mark succeeds deletes the key and cleans up with a Find
+bool
+LockFreeSkipList::Delete(LL key)
+{
+  Node* preds[MAX_LEVEL + 1];
+  Node* succs[MAX_LEVEL + 1];
+  bool marked;
+  if (!Find(key, preds, succs)) return false;
+  Node* victim = succs[0];
+  for (int l = victim->topLevel; l >= 1; l--) {
+    Node* succ = victim->next[l].Get(&marked);
+    while (!marked) {
+      victim->next[l].CompareAndSet(succ, succ, false, true);
+      succ = victim->next[l].Get(&marked);
+    }
+  }
+  Node* succ = victim->next[0].Get(&marked);
+  while (true) {
+    if (marked) return false;   // Another Delete got there first
+    if (victim->next[0].CompareAndSet(succ, succ, false, true)) {
+      BackoffDone();
+      MemKeys(-1);
+      MemRetire(NodeSize(victim->topLevel));
+      Find(key, preds, succs);
+      return true;
+    }
+    Backoff();
+    succ = victim->next[0].Get(&marked);
+  }
+}
+
+// The first node at the bottom level with a key not below key, skipping
+// marked nodes without snipping them
+Node*
+LockFreeSkipList::Ceiling(LL key)
+{
+  bool marked;
+  Node* pred = head;
+  Node* curr = NULL;
+  for (int level = MAX_LEVEL; level >= 0; level--) {
+    curr = pred->next[level].GetReference();
+    while (true) {
+      Node* succ = curr->next[level].Get(&marked);
+      while (marked) {
+        curr = succ;
+        succ = curr->next[level].Get(&marked);
+      }
+      if (curr->key < key) {
+        pred = curr;
+        curr = succ;
+      } else {
+        break;
+      }
+    }
+  }
+  return curr;
+}
+
+bool
+LockFreeSkipList::Search(LL key)
+{
+  return Ceiling(key)->key == key;
+}
+
+// Copy the keys in [lo, hi] to out in ascending order, at most limit of them,
+// or only count them if out is NULL; returns the number of keys
+// Not a snapshot: a key present for the whole scan is reported, and a key
+// that is reported was present when the scan passed it
+long
+LockFreeSkipList::RangeScan(LL lo, LL hi, LL* out, long limit)
+{
+  bool marked;
+  long n = 0;
+  Node* curr = Ceiling(lo);
+  while (curr != tail && curr->key <= hi && n < limit) {
+    Node* succ = curr->next[0].Get(&marked);
+    if (!marked) {
+      if (out != NULL) out[n] = curr->key;
+      n++;
+    }
+    curr = succ;
+  }
+  return n;
+}
+
+// The smallest key above key; false if there is none
+bool
+LockFreeSkipList::Successor(LL key, LL* out)
+{
+  if (key == (LL)0xffffffffffffffff) return false;
+  Node* curr = Ceiling(key + 1);
+  if (curr == tail) return false;
+  *out = curr->key;
+  return true;
+}
+
+#ifdef PERF_COUNTERS
+PerfGroup* counters;    // One counter group per thread
+PerfTotals totals;
+#endif
+
+// Each thread drains its own contiguous range, then steals from the others
+
+void Thread (int tid, Dispatcher* d)
+{
+  long i, begin, end;
+#ifdef PERF_COUNTERS
+  counters[tid].Start();
+#endif
+  while (d->Next(tid, &begin, &end)) {
+    for (i=begin;i<end;i++) {
+       LL item = items[i];
+       switch(op[i]){
+         case ADD:
+           result[i]=10+s.Add(item);
+           break;
+         case DELETE:
+           result[i]=20+s.Delete(item);
+           break;
+         case SEARCH:
+           result[i]=30+s.Search(item);
+           break;
+         case RANGE:
+           result[i]=40+(s.RangeScan(item, item+RANGE_SPAN-1, NULL, RANGE_SPAN)>0);
+           break;
+       }
+    }
+  }
+#ifdef PERF_COUNTERS
+  counters[tid].Stop();
+#endif
+}
+
+int main(int argc, char** argv) {
+
+  if (argc != 4 && argc != 5) {
+     printf("Usage: %s <percent add ops> <percent delete ops> <num threads> [<percent range scans>]\n", argv[0]);
+     printf("Example: %s 30 50 4 5\n", argv[0]);
+     exit(1);
+  }
+
+  int adds = atoi(argv[1]);
+  int deletes = atoi(argv[2]);
+  int num_threads = atoi(argv[3]);
+  int ranges = argc == 5 ? atoi(argv[4]) : 0;
+
+  if (adds + deletes + ranges > 100) {
+     printf("Sum of add, delete and range percentages exceeds 100.\nAborting...\n");
+     exit(1);
+  }
+
+  omp_set_num_threads(num_threads);
+  srand(0);
+  int i;
+  for(i=0;i<NUM_ITEMS;i++){
+    items[i]=10+rand()%KEYS;
+  }
+
+  for(i=0;i<(NUM_ITEMS*adds)/100;i++){
+    op[i]=ADD;
+  }
+  for(;i<(NUM_ITEMS*(adds+deletes))/100;i++){
+    op[i]=DELETE;
+  }
+  for(;i<(NUM_ITEMS*(adds+deletes+ranges))/100;i++){
+    op[i]=RANGE;
+  }
+  for(;i<NUM_ITEMS;i++){
+    op[i]=SEARCH;
+  }
+  ShuffleOps(op, NUM_ITEMS);
+
+  Dispatcher d(NUM_ITEMS, num_threads, AFFINITY);
+
+#ifdef PERF_COUNTERS
+  counters = new PerfGroup[num_threads];
+#endif
+
+  // Pin the team before timing; OpenMP reuses the same threads below
+  #pragma omp parallel
+  {
+    d.Pin(omp_get_thread_num());
+#ifdef PERF_COUNTERS
+    counters[omp_get_thread_num()].Open();
+#endif
+  }
+
+  struct timeval tv0,tv1;
+  struct timezone tz0,tz1;
+
+  gettimeofday(&tv0,&tz0);
+  #pragma omp parallel
+  {
+    Thread(omp_get_thread_num(), &d);
+  }
+  gettimeofday(&tv1,&tz1);
+
+  printf("%lf\n",((float)((tv1.tv_sec-tv0.tv_sec)*1000000+(tv1.tv_usec-tv0.tv_usec)))/1000.0);
+
+#ifdef PERF_COUNTERS
+  for(i=0;i<num_threads;i++){
+    counters[i].Accumulate(&totals);
+  }
+  totals.Report(NUM_ITEMS);
+#endif
+  MemReport();
+
+  return 0;
+}
@@ -4,6 +4,18 @@
 #include "omp.h"
 #include "assert.h"
 #include "sys/time.h"
+#include "stdint.h"
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include "dispatch.h"
+#include "hugepage.h"
+#include "fingerprint.h"
+#include "memstat.h"
+#include <new>
+#ifdef PERF_COUNTERS
+#include "perfctr.h"
+#endif
 
 #if __WORDSIZE == 64
 typedef unsigned long long LL;
@@ -24,6 +36,49 @@ LL* op;
 LL* result;   
 int NUM_ITEMS, NUM_THREADS, KEYS;
 
+#ifdef QUOTIENT
+
+// Compact mode: every key of bucket b is q * NUM_BUCKETS + b, so a bucket only
+// stores the quotient q in 32 bits and rebuilds the key when it needs it.
+// The chain is unrolled into cache-line nodes of sorted quotients.
+// Keys must be below 2^32 * NUM_BUCKETS; the table rejects larger ones, whose
+// quotient would be truncated onto another key's.
+typedef uint32_t Slot;
+
+#define QUOTIENT_MAX (0xFFFFFFFFULL)
+
+// Quotients that fit in a chain node
+#define CHUNK_KEYS ((64 - sizeof(void*) - sizeof(unsigned)) / sizeof(Slot))
+
+// Chain nodes go on huge pages with -DHUGE_PAGES
+__thread HugeNodePool chainNodes;
+
+// Nodes come from plain new without the flag; asking for line alignment would
+// double the allocator overhead, which is most of what the compact mode saves.
+// Huge-page slabs hand them out back to back, so each is one aligned line
+class Node
+{
+public:
+    Node* next;
+    unsigned count;                 // Quotients held, never 0 in a chain
+    Slot keys[CHUNK_KEYS];          // Sorted
+
+    Node() : next(NULL), count(0) {}
+
+    // Counted with -DMEM_STATS
+    static void* operator new(size_t bytes) { MemAlloc(bytes); return HugeNodeAlloc(&chainNodes, bytes); }
+    static void operator delete(void* p, size_t bytes) { MemFree(bytes); HugeNodeFree(&chainNodes, p); }
+};
+
+static_assert(sizeof(Node) == 64, "chain node must be one cache line long");
+
+#else
+
+typedef LL Slot;
+
+// Chain nodes go on huge pages with -DHUGE_PAGES
+__thread HugeNodePool chainNodes;
+
 class Node
 {
 public:
@@ -31,52 +86,357 @@ public:
     Node* next;
 
     Node(LL k) : key(k), next(NULL) {}
+
+    // Counted with -DMEM_STATS
+    static void* operator new(size_t bytes) { MemAlloc(bytes); return HugeNodeAlloc(&chainNodes, bytes); }
+    static void operator delete(void* p, size_t bytes) { MemFree(bytes); HugeNodeFree(&chainNodes, p); }
 };
 
-class LockBasedList
+#endif
+
+// First position in a[0..n) whose slot is not below q
+inline int Position(const Slot* a, int n, Slot q)
+{
+    int i = 0;
+    while (i < n && a[i] < q) i++;
+    return i;
+}
+
+inline void InsertAt(Slot* a, int n, int pos, Slot q)
+{
+    for (int j = n; j > pos; j--) a[j] = a[j - 1];
+    a[pos] = q;
+}
+
+inline void EraseAt(Slot* a, int n, int pos)
+{
+    for (int j = pos; j < n - 1; j++) a[j] = a[j + 1];
+}
+
+// Op of a batch, as ordered by LockBasedHashTable::ApplyBatch
+struct BatchItem
+{
+    LL bucket;
+    LL key;
+    long index;     // Position in the batch
+};
+
+// Bucket bits per radix pass of ApplyBatch
+#define BATCH_RADIX 7
+
+// Runs of one bucket up to this long are sorted by insertion
+#define BATCH_INSERTION 16
+
+// Keys that fit in the cache line of a bucket header
+#define INLINE_KEYS ((64 - sizeof(omp_lock_t) - 2 * sizeof(short) - sizeof(uint64_t) - sizeof(Node*)) / sizeof(Slot))
+
+// Deletes after which a bucket filter is rebuilt from the keys present
+#define FILTER_STALE 8
+
+// Bucket header, stored inline in the bucket array and padded to one cache line
+// The smallest INLINE_KEYS keys of the bucket live in the header, the rest
+// in a sorted chain of nodes. The chain is only used once the header is full.
+// The filter is a Bloom word over the keys of the bucket. It is set under the
+// lock on Add and rebuilt from the keys present after FILTER_STALE deletes, so
+// Search can reject a key whose bits are clear without taking the lock.
+
+class __attribute__((aligned (64))) LockBasedList
 {
 private:
-    Node* head;
     omp_lock_t listLock;
+    unsigned short count;           // Number of keys held inline
+    unsigned short stale;           // Deletes since the filter was rebuilt
+    std::atomic<uint64_t> filter;   // Superset of the fingerprints of the keys
+    Slot keys[INLINE_KEYS];         // Inline keys, sorted
+    Node* chain;                    // Overflow chain, sorted, all larger than keys[]
+
+    // Called with the lock held
+
+    void AddFingerprint(LL key)
+    {
+        filter.store(filter.load(std::memory_order_relaxed) | Fingerprint(key), std::memory_order_release);
+    }
+
+#ifdef QUOTIENT
+    // rem is the bucket index, the remainder shared by all keys
+    void RebuildFilter(LL rem)
+    {
+        uint64_t f = 0;
+        for (int i = 0; i < count; i++) f |= Fingerprint((LL)keys[i] * NUM_BUCKETS + rem);
+        for (Node* curr = chain; curr != NULL; curr = curr->next)
+            for (unsigned j = 0; j < curr->count; j++) f |= Fingerprint((LL)curr->keys[j] * NUM_BUCKETS + rem);
+        filter.store(f, std::memory_order_release);
+        stale = 0;
+    }
+
+    // Push q, smaller than every quotient in the chain, onto its front
+    void Spill(Slot q)
+    {
+        if (chain == NULL || chain->count == CHUNK_KEYS) {
+            Node* first = new Node();
+            first->next = chain;
+            chain = first;
+        }
+        InsertAt(chain->keys, chain->count, 0, q);
+        chain->count++;
+    }
+
+    // Remove keys[pos] of the node at *link, unlinking the node once empty
+    void Remove(Node** link, int pos)
+    {
+        Node* curr = *link;
+        EraseAt(curr->keys, curr->count, pos);
+        if (--curr->count == 0) {
+            *link = curr->next;
+            delete curr;
+        }
+    }
+
+    // Put q at inline position i; a full header spills its largest quotient
+    void InsertInline(int i, Slot q)
+    {
+        if (count == (int)INLINE_KEYS) Spill(keys[--count]);
+        InsertAt(keys, count, i, q);
+        count++;
+    }
+
+    // Remove inline quotient i, refilling the header from the chain
+    void RemoveInline(int i)
+    {
+        EraseAt(keys, count, i);
+        count--;
+        if (chain != NULL) {
+            keys[count++] = chain->keys[0];
+            Remove(&chain, 0);
+        }
+    }
+
+    // Advance link to the node that holds q or would take it: the first node
+    // whose last quotient is not below q, else the last node
+    Node** Seek(Node** link, Slot q)
+    {
+        while (*link != NULL && (*link)->next != NULL && (*link)->keys[(*link)->count - 1] < q)
+            link = &(*link)->next;
+        return link;
+    }
+
+    // Position of q in the node Seek found, or -1
+    int FindChunk(Node** link, Slot q)
+    {
+        Node* curr = *link;
+        if (curr == NULL) return -1;
+        int j = Position(curr->keys, curr->count, q);
+        return (j < (int)curr->count && curr->keys[j] == q) ? j : -1;
+    }
+
+    // Insert q into the node Seek found, splitting it when full
+    // Returns false if q is present
+    bool InsertChunk(Node** link, Slot q)
+    {
+        if (*link == NULL) *link = new Node();
+        Node* curr = *link;
+        int j = Position(curr->keys, curr->count, q);
+        if (j < (int)curr->count && curr->keys[j] == q) return false;
+        if (curr->count == CHUNK_KEYS) {
+            // Split the node; its upper half moves to a new node after it
+            Node* upper = new Node();
+            int half = CHUNK_KEYS / 2;
+            upper->count = CHUNK_KEYS - half;
+            for (unsigned k = 0; k < upper->count; k++) upper->keys[k] = curr->keys[half + k];
+            curr->count = half;
+            upper->next = curr->next;
+            curr->next = upper;
+            if (j > half) {
+                curr = upper;
+                j -= half;
+            }
+        }
+        InsertAt(curr->keys, curr->count, j, q);
+        curr->count++;
+        return true;
+    }
+#else
+    void RebuildFilter()
+    {
+        uint64_t f = 0;
+        for (int i = 0; i < count; i++) f |= Fingerprint(keys[i]);
+        for (Node* curr = chain; curr != NULL; curr = curr->next) f |= Fingerprint(curr->key);
+        filter.store(f, std::memory_order_release);
+        stale = 0;
+    }
+
+    // Put key at inline position i; a full header spills its largest key
+    void InsertInline(int i, LL key)
+    {
+        if (count == (int)INLINE_KEYS) {
+            Node* spill = new Node(keys[count - 1]);
+            spill->next = chain;
+            chain = spill;
+            count--;
+        }
+        InsertAt(keys, count, i, key);
+        count++;
+    }
+
+    // Remove inline key i, refilling the header from the chain
+    void RemoveInline(int i)
+    {
+        EraseAt(keys, count, i);
+        count--;
+        if (chain != NULL) {
+            Node* first = chain;
+            keys[count++] = first->key;
+            chain = first->next;
+            delete first;
+        }
+    }
+#endif
 
 public:
     LockBasedList()
     {
-        head = new Node(0); // Initialize head with dummy value
         omp_init_lock(&listLock); // Initialize the lock
+        count = 0;
+        stale = 0;
+        filter.store(0, std::memory_order_relaxed);
+        chain = NULL;
     }
 
     ~LockBasedList()
     {
+        Clear();
         omp_destroy_lock(&listLock); // Destroy the lock
-        // Free list nodes
-        Node* current = head;
+    }
+
+    // Drop every key; the list is ready for use again at once
+    // The chain is detached under the lock and freed after it is released
+    void Clear()
+    {
+        omp_set_lock(&listLock); // Lock the list
+        Node* current = chain;
+        long n = count;
+        chain = NULL;
+        count = 0;
+        stale = 0;
+        filter.store(0, std::memory_order_release);
+        omp_unset_lock(&listLock); // Unlock the list
         while(current != NULL) {
             Node* next = current->next;
+#ifdef QUOTIENT
+            n += current->count;
+#else
+            n++;
+#endif
             delete current;
             current = next;
         }
+        MemKeys(-n);
     }
 
+#ifdef QUOTIENT
+    bool Add(LL key)
+    {
+        Slot q = (Slot)(key / NUM_BUCKETS);
+        omp_set_lock(&listLock); // Lock the list
+
+        int i = Position(keys, count, q);
+        if (i < count && keys[i] == q) {
+            omp_unset_lock(&listLock); // Unlock the list
+            return false; // Key already present
+        }
+
+        if (i < count || count < (int)INLINE_KEYS) {
+            // The key belongs in the header
+            InsertInline(i, q);
+        } else if (!InsertChunk(Seek(&chain, q), q)) {
+            omp_unset_lock(&listLock); // Unlock the list
+            return false; // Key already present
+        }
+        AddFingerprint(key);
+        MemKeys(1);
+        omp_unset_lock(&listLock); // Unlock the list
+        return true;
+    }
+
+    bool Delete(LL key)
+    {
+        Slot q = (Slot)(key / NUM_BUCKETS);
+        omp_set_lock(&listLock); // Lock the list
+        int i = Position(keys, count, q);
+        if (i < count) {
+            if (keys[i] != q) {
+                omp_unset_lock(&listLock); // Unlock the list
+                return false; // Key not found
+            }
+            RemoveInline(i);
+        } else {
+            Node** link = Seek(&chain, q);
+            int j = FindChunk(link, q);
+            if (j < 0) {
+                omp_unset_lock(&listLock); // Unlock the list
+                return false; // Key not found
+            }
+            Remove(link, j);
+        }
+        if (++stale >= FILTER_STALE) RebuildFilter(key % NUM_BUCKETS);
+        MemKeys(-1);
+        omp_unset_lock(&listLock); // Unlock the list
+        return true; // Key found and deleted
+    }
+
+    bool Search(LL key)
+    {
+        uint64_t fp = Fingerprint(key);
+        if ((filter.load(std::memory_order_acquire) & fp) != fp)
+            return false; // Key cannot be present
+        Slot q = (Slot)(key / NUM_BUCKETS);
+        bool found = false;
+        omp_set_lock(&listLock); // Lock the list
+        int i = Position(keys, count, q);
+        if (i < count) {
+            found = (keys[i] == q);
+        } else {
+            found = (FindChunk(Seek(&chain, q), q) >= 0);
+        }
+        omp_unset_lock(&listLock); // Unlock the list
+        return found;
+    }
+#else
     bool Add(LL key) {
       omp_set_lock(&listLock); // Acquire lock
 
-      Node* pred = head;
-      Node* curr = head->next;
+      int i = 0;
+      while (i < count && keys[i] < key) i++;
+
+      if (i < count && keys[i] == key) {
+        omp_unset_lock(&listLock); // Key found, release lock and return false
+        return false;
+      }
+
+      if (i < count || count < (int)INLINE_KEYS) {
+        // The key belongs in the header
+        InsertInline(i, key);
+        AddFingerprint(key);
+        MemKeys(1);
+        omp_unset_lock(&listLock); // Release lock
+        return true;
+      }
 
-      // Traverse the list to find the insert location or existing key
-      while (curr != nullptr && curr->key < key) {
-        pred = curr;
-        curr = curr->next;
+      // Traverse the chain to find the insert location or existing key
+      Node** link = &chain;
+      while (*link != nullptr && (*link)->key < key) {
+        link = &(*link)->next;
       }
 
-      if (curr != nullptr && curr->key == key) {
+      if (*link != nullptr && (*link)->key == key) {
         omp_unset_lock(&listLock); // Key found, release lock and return false
         return false;
       } else {
         Node* newNode = new Node(key);
-        newNode->next = curr;
-        pred->next = newNode;
+        newNode->next = *link;
+        *link = newNode;
+        AddFingerprint(key);
+        MemKeys(1);
         omp_unset_lock(&listLock); // Release lock
         return true;
       }
@@ -85,17 +445,31 @@ public:
     bool Delete(LL key)
     {
         omp_set_lock(&listLock); // Lock the list
-        Node *prev = head;
-        Node *curr = head->next;
-        while(curr != NULL) {
+        int i = 0;
+        while (i < count && keys[i] < key) i++;
+        if (i < count) {
+            if (keys[i] != key) {
+                omp_unset_lock(&listLock); // Unlock the list
+                return false; // Key not found
+            }
+            RemoveInline(i);
+            if (++stale >= FILTER_STALE) RebuildFilter();
+            MemKeys(-1);
+            omp_unset_lock(&listLock); // Unlock the list
+            return true; // Key found and deleted
+        }
+        Node** link = &chain;
+        while(*link != NULL && (*link)->key <= key) {
+            Node* curr = *link;
             if(curr->key == key) {
-                prev->next = curr->next;
+                *link = curr->next;
                 delete curr;
+                if (++stale >= FILTER_STALE) RebuildFilter();
+                MemKeys(-1);
                 omp_unset_lock(&listLock); // Unlock the list
                 return true; // Key found and deleted
             }
-            prev = curr;
-            curr = curr->next;
+            link = &curr->next;
         }
         omp_unset_lock(&listLock); // Unlock the list
         return false; // Key not found
@@ -103,9 +477,19 @@ public:
 
     bool Search(LL key)
     {
+        uint64_t fp = Fingerprint(key);
+        if ((filter.load(std::memory_order_acquire) & fp) != fp)
+            return false; // Key cannot be present
         omp_set_lock(&listLock); // Lock the list
-        Node* curr = head->next;
-        while(curr != NULL) {
+        int i = 0;
+        while (i < count && keys[i] < key) i++;
+        if (i < count) {
+            bool found = (keys[i] == key);
+            omp_unset_lock(&listLock); // Unlock the list
+            return found;
+        }
+        Node* curr = chain;
+        while(curr != NULL && curr->key <= key) {
             if(curr->key == key) {
                 omp_unset_lock(&listLock); // Unlock the list
                 return true; // Key found
@@ -115,12 +499,88 @@ public:
         omp_unset_lock(&listLock); // Unlock the list
         return false; // Key not found
     }
+#endif
+
+    // Apply the items[0..m) of a batch under one hold of the lock
+    // The items are in ascending key order, ops on one key in batch order;
+    // out[i] gets the outcome of op i. Header keys are handled op by op, then
+    // the chain is merged in one forward pass: once a key falls past a full
+    // header, so do all larger ones
+    void Apply(const LL* ops, const BatchItem* items, long m, bool* out)
+    {
+        long added = 0, removed = 0;
+        omp_set_lock(&listLock); // Lock the list
+        Node** link = &chain;    // Chain cursor, only moves forward
+        for (long k = 0; k < m; k++) {
+            long b = items[k].index;
+            LL key = items[k].key;
+#ifdef QUOTIENT
+            Slot s = (Slot)(key / NUM_BUCKETS);
+#else
+            Slot s = key;
+#endif
+            bool found;
+            int i = Position(keys, count, s);
+            if (i < count || count < (int)INLINE_KEYS) {
+                found = (i < count && keys[i] == s);
+                if (ops[b] == ADD && !found) InsertInline(i, s);
+                else if (ops[b] == DELETE && found) RemoveInline(i);
+                link = &chain; // The chain front may have changed
+            } else {
+#ifdef QUOTIENT
+                link = Seek(link, s);
+                if (ops[b] == ADD) {
+                    found = !InsertChunk(link, s);
+                } else {
+                    int j = FindChunk(link, s);
+                    found = (j >= 0);
+                    if (ops[b] == DELETE && found) Remove(link, j);
+                }
+#else
+                while (*link != NULL && (*link)->key < s) link = &(*link)->next;
+                found = (*link != NULL && (*link)->key == s);
+                if (ops[b] == ADD && !found) {
+                    Node* newNode = new Node(s);
+                    newNode->next = *link;
+                    *link = newNode;
+                } else if (ops[b] == DELETE && found) {
+                    Node* curr = *link;
+                    *link = curr->next;
+                    delete curr;
+                }
+#endif
+            }
+            if (ops[b] == ADD) {
+                out[b] = !found;
+                if (!found) {
+                    AddFingerprint(key);
+                    added++;
+                }
+            } else {
+                out[b] = found;
+                if (ops[b] == DELETE && found) {
+                    stale++;
+                    removed++;
+                }
+            }
+        }
+        // One rebuild for the whole sub-batch; the filter stays a superset meanwhile
+#ifdef QUOTIENT
+        if (stale >= FILTER_STALE) RebuildFilter(items[0].bucket);
+#else
+        if (stale >= FILTER_STALE) RebuildFilter();
+#endif
+        MemKeys(added - removed);
+        omp_unset_lock(&listLock); // Unlock the list
+    }
 };
 
+static_assert(sizeof(LockBasedList) == 64, "bucket header must fill exactly one cache line");
+
 class LockBasedHashTable
 {
 private:
-    LockBasedList* buckets[NUM_BUCKETS];
+    LockBasedList* buckets;     // Bucket headers, one contiguous array
 
     LL Hash(LL key)
     {
@@ -128,34 +588,103 @@ private:
     }
 
 public:
+    // The bucket array goes on huge pages with -DHUGE_PAGES
     LockBasedHashTable()
     {
-        for(int i = 0; i < NUM_BUCKETS; ++i)
-            buckets[i] = new LockBasedList();
+        buckets = (LockBasedList*)HugeAlloc(NUM_BUCKETS * sizeof(LockBasedList));
+        for (int i = 0; i < NUM_BUCKETS; i++)
+            new (&buckets[i]) LockBasedList();
+        MemAlloc(NUM_BUCKETS * sizeof(LockBasedList));
     }
 
     ~LockBasedHashTable()
     {
-        for(int i = 0; i < NUM_BUCKETS; ++i)
-            delete buckets[i];
+        for (int i = 0; i < NUM_BUCKETS; i++)
+            buckets[i].~LockBasedList();
+        HugeFree(buckets, NUM_BUCKETS * sizeof(LockBasedList));
+        MemFree(NUM_BUCKETS * sizeof(LockBasedList));
+    }
+
+    // Empty every bucket, in parallel; the table stays usable
+    void Clear()
+    {
+        #pragma omp parallel for schedule(static, 256)
+        for (int i = 0; i < NUM_BUCKETS; i++)
+            buckets[i].Clear();
     }
 
     bool Add(LL key)
     {
         LL index = Hash(key);
-        return buckets[index]->Add(key);
+#ifdef QUOTIENT
+        if (key / NUM_BUCKETS > QUOTIENT_MAX) return false; // Cannot be stored, rejected
+#endif
+        return buckets[index].Add(key);
     }
 
     bool Delete(LL key)
     {
         LL index = Hash(key);
-        return buckets[index]->Delete(key);
+#ifdef QUOTIENT
+        if (key / NUM_BUCKETS > QUOTIENT_MAX) return false; // Cannot be stored
+#endif
+        return buckets[index].Delete(key);
     }
 
     bool Search(LL key)
     {
         LL index = Hash(key);
-        return buckets[index]->Search(key);
+#ifdef QUOTIENT
+        if (key / NUM_BUCKETS > QUOTIENT_MAX) return false; // Cannot be stored
+#endif
+        return buckets[index].Search(key);
+    }
+
+    // Apply n operations (ADD, DELETE or SEARCH), taking each bucket lock once
+    // results[i] gets the outcome of op i. The batch is ordered by bucket and
+    // key, so ops on different keys take effect in key order, ops on one key
+    // in batch order.
+    // A stable radix sort groups the ops by bucket in a few linear passes, and
+    // each run is then sorted by key, which keeps the batch order of equal keys
+    void ApplyBatch(const LL* ops, const LL* keys, long n, bool* results)
+    {
+        std::vector<BatchItem> batch, spare;
+        batch.reserve(n);
+        for (long i = 0; i < n; i++) {
+#ifdef QUOTIENT
+            if (keys[i] / NUM_BUCKETS > QUOTIENT_MAX) {
+                results[i] = false; // Cannot be stored; an add is rejected
+                continue;
+            }
+#endif
+            batch.push_back({Hash(keys[i]), keys[i], i});
+        }
+        spare.resize(batch.size());
+        for (int shift = 0; ((NUM_BUCKETS - 1) >> shift) != 0; shift += BATCH_RADIX) {
+            long start[(1 << BATCH_RADIX) + 1] = {0};
+            for (size_t i = 0; i < batch.size(); i++)
+                start[((batch[i].bucket >> shift) & ((1 << BATCH_RADIX) - 1)) + 1]++;
+            for (int d = 0; d < (1 << BATCH_RADIX); d++)
+                start[d + 1] += start[d];
+            for (size_t i = 0; i < batch.size(); i++)
+                spare[start[(batch[i].bucket >> shift) & ((1 << BATCH_RADIX) - 1)]++] = batch[i];
+            batch.swap(spare);
+        }
+        for (size_t s = 0, e; s < batch.size(); s = e) {
+            for (e = s + 1; e < batch.size() && batch[e].bucket == batch[s].bucket; e++);
+            if (e - s > BATCH_INSERTION) {
+                std::stable_sort(batch.begin() + s, batch.begin() + e,
+                                 [](const BatchItem& a, const BatchItem& b) { return a.key < b.key; });
+            } else {
+                for (size_t i = s + 1; i < e; i++) {
+                    BatchItem item = batch[i];
+                    size_t j = i;
+                    for (; j > s && batch[j - 1].key > item.key; j--) batch[j] = batch[j - 1];
+                    batch[j] = item;
+                }
+            }
+            buckets[batch[s].bucket].Apply(ops, &batch[s], e - s, results);
+        }
     }
 };
 
@@ -178,9 +707,10 @@ int main(int argc, char** argv) {
     int deletes = atoi(argv[5]);
 
     // Allocate memory for the arrays based on NUM_ITEMS
+    // The result array is line aligned so that dispatched chunks own whole lines
     items = new LL[NUM_ITEMS];
     op = new LL[NUM_ITEMS];
-    result = new LL[NUM_ITEMS];
+    result = (LL*)aligned_alloc(64, ((NUM_ITEMS * sizeof(LL) + 63) / 64) * 64);
 
     if (adds + deletes > 100) {
         printf("Sum of add and delete percentages exceeds 100.\nAborting...\n");
@@ -206,8 +736,24 @@ int main(int argc, char** argv) {
     for (int i = totalAdds + totalDeletes; i < NUM_ITEMS; i++) {
         op[i] = SEARCH;
     }
+    ShuffleOps(op, NUM_ITEMS);
 
     LockBasedHashTable h; // Use LockBasedHashTable instead of LockFreeHashTable
+    Dispatcher d(NUM_ITEMS, NUM_THREADS, AFFINITY);
+
+#ifdef PERF_COUNTERS
+    PerfGroup* counters = new PerfGroup[NUM_THREADS];
+    PerfTotals totals;
+#endif
+
+    // Pin the team before timing; OpenMP reuses the same threads below
+#pragma omp parallel num_threads(NUM_THREADS)
+    {
+        d.Pin(omp_get_thread_num());
+#ifdef PERF_COUNTERS
+        counters[omp_get_thread_num()].Open();
+#endif
+    }
 
     struct timeval tv0, tv1;
     struct timezone tz0, tz1;
@@ -215,25 +761,44 @@ int main(int argc, char** argv) {
     gettimeofday(&tv0, &tz0);
 
     // Parallel section
-    // We will use OpenMP to parallelize this loop
+    // Each thread drains its own contiguous range, then steals from the others
 #pragma omp parallel num_threads(NUM_THREADS)
     {
         int tid = omp_get_thread_num(); // Get the thread ID in the current context
-        #pragma omp for
-        for (int i = tid; i < NUM_ITEMS; i += NUM_THREADS) {
-            // Perform operations based on the op array
-            switch(op[i]) {
-                case ADD:
-                    result[i] = 10 + h.Add(items[i]);
-                    break;
-                case DELETE:
-                    result[i] = 20 + h.Delete(items[i]);
-                    break;
-                case SEARCH:
-                    result[i] = 30 + h.Search(items[i]);
-                    break;
+        long begin, end;
+#ifdef PERF_COUNTERS
+        counters[tid].Start();
+#endif
+#ifdef BATCH
+        // Every dispatched chunk goes to the table as one batch
+        bool* outs = new bool[DISPATCH_CHUNK];
+        while (d.Next(tid, &begin, &end)) {
+            h.ApplyBatch(&op[begin], &items[begin], end - begin, outs);
+            for (long i = begin; i < end; i++)
+                result[i] = 10 * (op[i] + 1) + outs[i - begin];
+        }
+        delete[] outs;
+#else
+        while (d.Next(tid, &begin, &end)) {
+            for (long i = begin; i < end; i++) {
+                // Perform operations based on the op array
+                switch(op[i]) {
+                    case ADD:
+                        result[i] = 10 + h.Add(items[i]);
+                        break;
+                    case DELETE:
+                        result[i] = 20 + h.Delete(items[i]);
+                        break;
+                    case SEARCH:
+                        result[i] = 30 + h.Search(items[i]);
+                        break;
+                }
             }
         }
+#endif
+#ifdef PERF_COUNTERS
+        counters[tid].Stop();
+#endif
     }
 
     gettimeofday(&tv1, &tz1);
@@ -241,8 +806,17 @@ int main(int argc, char** argv) {
     // Calculate and print elapsed time in ms
     printf("%lf\n", ((double)((tv1.tv_sec - tv0.tv_sec) * 1000000 + (tv1.tv_usec - tv0.tv_usec))) / 1000.0);
 
+#ifdef PERF_COUNTERS
+    for (int t = 0; t < NUM_THREADS; t++)
+        counters[t].Accumulate(&totals);
+    totals.Report(NUM_ITEMS);
+    delete[] counters;
+#endif
+    HugeReport();
+    MemReport();
+
     delete[] items;
     delete[] op;
-    delete[] result;
+    free(result);
     return 0;
 }
@@ -0,0 +1,56 @@
+// backoff.h
+//
+// Contention management for the CAS retry loops of the lock-free tables.
+//
+// A thread whose CAS fails calls Backoff(), which spins for a random number
+// of pause instructions below the thread's current limit and then doubles the
+// limit, up to BACKOFF_MAX. Each completed update calls BackoffDone(), which
+// halves the limit again, down to BACKOFF_MIN, so the delay follows the
+// contention the thread has seen recently. Compile with -DBACKOFF_MAX=0 to
+// turn backoff off.
+
+#ifndef BACKOFF_H
+#define BACKOFF_H
+
+#ifndef BACKOFF_MIN
+#define BACKOFF_MIN 4
+#endif
+
+#ifndef BACKOFF_MAX
+#define BACKOFF_MAX 1024
+#endif
+
+__thread unsigned backoffLimit;   // 0 until the first failure
+__thread unsigned backoffSeed;
+
+inline void CpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+inline void Backoff()
+{
+  if (BACKOFF_MAX == 0) return;
+  if (backoffLimit < BACKOFF_MIN) {
+    backoffLimit = BACKOFF_MIN;
+    backoffSeed = (unsigned)(unsigned long)&backoffLimit | 1;
+  }
+  // xorshift, private to the thread
+  backoffSeed ^= backoffSeed << 13;
+  backoffSeed ^= backoffSeed >> 17;
+  backoffSeed ^= backoffSeed << 5;
+  for (unsigned k = backoffSeed % backoffLimit; k > 0; k--)
+    CpuRelax();
+  if (backoffLimit < BACKOFF_MAX) backoffLimit <<= 1;
+}
+
+inline void BackoffDone()
+{
+  if (backoffLimit > BACKOFF_MIN) backoffLimit >>= 1;
+}
+
+#endif // BACKOFF_H
@@ -0,0 +1,256 @@
+// changes.h
+//
+// Change stream of the tables: every successful add and delete is recorded
+// as an (op, key, sequence) record for consumers such as replicas and cache
+// invalidators. Compile with -DCHANGE_STREAM to enable.
+//
+// Each writer thread pushes its records into its own single-producer ring,
+// so the success path stores one record and publishes the ring tail, with no
+// shared line written besides the sequence counter. Consumers call
+// DrainChanges, which claims one ring at a time, so several consumers may
+// drain concurrently. A program that drains the stream calls ChangeConsumer
+// before its writers start; from then on a writer whose ring is full waits
+// for the consumer, so every change reaches the stream. Without a consumer a
+// full ring drops the record, and ChangeDrops tells how many were dropped.
+//
+// A table that records changes under a lock stages them with StageChange and
+// hands them to the stream and the log with PublishChanges after the lock is
+// released, so neither a full ring nor a full log ring stalls the other
+// threads waiting for that lock.
+//
+// Sequence numbers are taken after the operation has found its position and
+// before the CAS or under the lock that applies it, so the records of one key
+// carry increasing numbers in the order the operations took effect. A lock-free
+// table must make that CAS fail if the field changed after the number was
+// taken, even back to the value it read; CHANGE_NUMBERED tells it to. Records
+// of different rings come out interleaved; a consumer that applies a record
+// only when its number exceeds the last one applied to the key converges to
+// the table. Numbers of failed attempts are skipped, so there are gaps.
+//
+// RecordChange also hands every change to the write-ahead log of wal.h, which
+// uses the same sequence numbers; -DWAL turns the numbering on by itself.
+//
+// Without either flag ChangeSequence, RecordChange, StageChange and
+// PublishChanges are empty and compile away.
+
+#ifndef CHANGES_H
+#define CHANGES_H
+
+#include "stdint.h"
+#include "stdlib.h"
+#include "sched.h"
+#include "backoff.h"
+#include <atomic>
+
+#define CHANGE_ADD (0)
+#define CHANGE_DELETE (1)
+
+struct ChangeRecord
+{
+  unsigned long long seq;
+  unsigned long long key;
+  int op;
+};
+
+#ifdef CHANGE_STREAM
+
+#ifndef CHANGE_SLOTS
+#define CHANGE_SLOTS 4096   // Records per ring, a power of two
+#endif
+
+static_assert((CHANGE_SLOTS & (CHANGE_SLOTS - 1)) == 0, "CHANGE_SLOTS must be a power of two");
+
+class ChangeRing
+{
+public:
+  ChangeRecord slots[CHANGE_SLOTS];
+  alignas(64) std::atomic<unsigned long> tail;  // Written by the producer
+  unsigned long headCache;                      // Producer's view of head
+  alignas(64) std::atomic<unsigned long> head;  // Written by the consumer
+  std::atomic<bool> claimed;                    // Held by the draining consumer
+  ChangeRing* link;                             // Next ring in the registry
+
+  ChangeRing()
+  {
+    tail.store(0, std::memory_order_relaxed);
+    headCache = 0;
+    head.store(0, std::memory_order_relaxed);
+    claimed.store(false, std::memory_order_relaxed);
+    link = NULL;
+  }
+};
+
+std::atomic<ChangeRing*> changeRings(NULL);   // Every ring ever created
+__thread ChangeRing* myRing;
+std::atomic<bool> changeConsumer(false);      // Full rings wait instead of dropping
+std::atomic<long> changeDrops(0);             // Records dropped on full rings
+
+// The ring of the calling thread, created on first use; rings are never freed
+inline ChangeRing* MyRing()
+{
+  if (myRing == NULL) {
+    ChangeRing* r = new ChangeRing();
+    r->link = changeRings.load(std::memory_order_relaxed);
+    while (!changeRings.compare_exchange_weak(r->link, r, std::memory_order_release, std::memory_order_relaxed));
+    myRing = r;
+  }
+  return myRing;
+}
+
+#endif // CHANGE_STREAM
+
+#if defined(CHANGE_STREAM) || defined(WAL)
+
+#define CHANGE_NUMBERED
+
+std::atomic<unsigned long long> changeSeq(0);
+
+inline unsigned long long ChangeSequence()
+{
+  return changeSeq.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+#else
+
+inline unsigned long long ChangeSequence()
+{
+  return 0;
+}
+
+#endif
+
+#include "wal.h"
+
+#ifdef CHANGE_STREAM
+
+// Declare that the stream is drained; call before the writers start
+inline void ChangeConsumer()
+{
+  changeConsumer.store(true, std::memory_order_release);
+}
+
+// Records dropped so far because a ring was full and no consumer was declared
+inline long ChangeDrops()
+{
+  return changeDrops.load(std::memory_order_relaxed);
+}
+
+// Push one record into the calling thread's ring
+inline void PushChange(int op, unsigned long long key, unsigned long long seq)
+{
+  ChangeRing* r = MyRing();
+  unsigned long t = r->tail.load(std::memory_order_relaxed);
+  // Full: spin briefly, then yield, in case the consumer needs this CPU
+  for (int spins = 0; t - r->headCache == CHANGE_SLOTS; spins++) {
+    r->headCache = r->head.load(std::memory_order_acquire);
+    if (t - r->headCache != CHANGE_SLOTS) break;
+    if (!changeConsumer.load(std::memory_order_acquire)) {
+      changeDrops.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    if (spins < 64) CpuRelax();
+    else sched_yield();
+  }
+  ChangeRecord* rec = &r->slots[t & (CHANGE_SLOTS - 1)];
+  rec->seq = seq;
+  rec->key = key;
+  rec->op = op;
+  r->tail.store(t + 1, std::memory_order_release);
+}
+
+inline void RecordChange(int op, unsigned long long key, unsigned long long seq)
+{
+  WalAppend(op, key, seq);
+  PushChange(op, key, seq);
+}
+
+
+// Move up to max records into out, ring by ring; returns the number moved
+// Rings another consumer is draining are skipped
+inline long DrainChanges(ChangeRecord* out, long max)
+{
+  long n = 0;
+  for (ChangeRing* r = changeRings.load(std::memory_order_acquire); r != NULL && n < max; r = r->link) {
+    if (r->claimed.exchange(true, std::memory_order_acquire)) continue;
+    unsigned long h = r->head.load(std::memory_order_relaxed);
+    unsigned long t = r->tail.load(std::memory_order_acquire);
+    for (; h != t && n < max; h++)
+      out[n++] = r->slots[h & (CHANGE_SLOTS - 1)];
+    r->head.store(h, std::memory_order_release);
+    r->claimed.store(false, std::memory_order_release);
+  }
+  return n;
+}
+
+#else
+
+inline void RecordChange(int op, unsigned long long key, unsigned long long seq)
+{
+  WalAppend(op, key, seq);
+}
+
+inline void ChangeConsumer()
+{
+}
+
+inline long ChangeDrops()
+{
+  return 0;
+}
+
+inline long DrainChanges(ChangeRecord* out, long max)
+{
+  return 0;
+}
+
+#endif // CHANGE_STREAM
+
+#if defined(CHANGE_STREAM) || defined(WAL)
+
+// Records of the calling thread taken under a lock, not yet recorded
+struct ChangeStage
+{
+  ChangeRecord* records;
+  long count;
+  long capacity;
+};
+
+__thread ChangeStage myStage;
+
+// As RecordChange, but the record waits in the calling thread's stage for
+// PublishChanges; for changes made under a lock
+inline void StageChange(int op, unsigned long long key, unsigned long long seq)
+{
+  ChangeStage& s = myStage;
+  if (s.count == s.capacity) {
+    s.capacity = s.capacity == 0 ? 64 : 2 * s.capacity;
+    s.records = (ChangeRecord*)realloc(s.records, s.capacity * sizeof(ChangeRecord));
+  }
+  ChangeRecord* rec = &s.records[s.count++];
+  rec->seq = seq;
+  rec->key = key;
+  rec->op = op;
+}
+
+// Record the staged changes of the calling thread; call with no lock held
+inline void PublishChanges()
+{
+  ChangeStage& s = myStage;
+  for (long i = 0; i < s.count; i++)
+    RecordChange(s.records[i].op, s.records[i].key, s.records[i].seq);
+  s.count = 0;
+}
+
+#else
+
+inline void StageChange(int op, unsigned long long key, unsigned long long seq)
+{
+}
+
+inline void PublishChanges()
+{
+}
+
+#endif
+
+#endif // CHANGES_H
@@ -0,0 +1,199 @@
+// dispatch.h
+//
+// Work distribution for the benchmark harnesses.
+//
+// The operation sequence [0, n) is split into one contiguous range per thread.
+// A thread claims DISPATCH_CHUNK items at a time from its own range and, once
+// that is drained, steals chunks from the ranges of the other threads. Range and
+// chunk boundaries are multiples of 8 items, so a 64-byte line of the result
+// array is only ever written by the thread that owns the chunk.
+//
+// Threads can optionally be pinned to CPUs. Compile with -DAFFINITY=1 for the
+// compact policy (consecutive threads share a core, then a package) or
+// -DAFFINITY=2 for the scatter policy (consecutive threads go to different
+// packages, then different cores).
+//
+// The harnesses keep the phased operation order (all adds, then deletes, then
+// searches) so results stay comparable with earlier runs. Compile with
+// -DSHUFFLE_OPS to shuffle it, so that every range sees the same mix.
+
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "sched.h"
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+// Affinity policies
+#define AFFINITY_NONE (0)
+#define AFFINITY_COMPACT (1)
+#define AFFINITY_SCATTER (2)
+
+#ifndef AFFINITY
+#define AFFINITY AFFINITY_NONE
+#endif
+
+// Items claimed per dispatch, must be a multiple of 8
+#ifndef DISPATCH_CHUNK
+#define DISPATCH_CHUNK 1024
+#endif
+
+static_assert(DISPATCH_CHUNK % 8 == 0, "DISPATCH_CHUNK must be a multiple of 8");
+
+// Per-thread range, padded so that claims by different threads do not collide
+
+class __attribute__((aligned (64))) WorkRange
+{
+  public:
+    std::atomic<long> next;     // First unclaimed item
+    long end;                   // One past the last item
+};
+
+class Dispatcher
+{
+  private:
+    WorkRange* ranges;
+    int nthreads;
+    std::vector<int> cpus;      // CPU for each thread slot, empty if not pinning
+
+    // Round down to a whole number of 64-byte lines of LL
+    static long Align(long x)
+    {
+      return x & ~7L;
+    }
+
+    static int ReadTopology(int cpu, const char* field, int fallback)
+    {
+      char path[128];
+      snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, field);
+      FILE* f = fopen(path, "r");
+      if (f == NULL) return fallback;
+      int v = fallback;
+      if (fscanf(f, "%d", &v) != 1) v = fallback;
+      fclose(f);
+      return v;
+    }
+
+    // Order the CPUs this process may run on according to the policy
+
+    void BuildCpuOrder(int policy)
+    {
+      cpu_set_t allowed;
+      if (policy == AFFINITY_NONE) return;
+      if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return;
+
+      struct Cpu { int id, pkg, core, smt, rank; };
+      std::vector<Cpu> list;
+      for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (!CPU_ISSET(c, &allowed)) continue;
+        Cpu x;
+        x.id = c;
+        x.pkg = ReadTopology(c, "physical_package_id", 0);
+        x.core = ReadTopology(c, "core_id", c);
+        x.smt = 0;
+        x.rank = 0;
+        list.push_back(x);
+      }
+
+      // Compact order: package, then core, then hardware thread
+      std::sort(list.begin(), list.end(), [](const Cpu& a, const Cpu& b) {
+        if (a.pkg != b.pkg) return a.pkg < b.pkg;
+        if (a.core != b.core) return a.core < b.core;
+        return a.id < b.id;
+      });
+
+      if (policy == AFFINITY_SCATTER) {
+        // Number each CPU by its hardware thread within the core and its
+        // core within the package, then deal them out round-robin
+        for (size_t i = 0; i < list.size(); i++) {
+          if (i == 0 || list[i].pkg != list[i-1].pkg) {
+            list[i].rank = 0;
+            list[i].smt = 0;
+          }
+          else if (list[i].core != list[i-1].core) {
+            list[i].rank = list[i-1].rank + 1;
+            list[i].smt = 0;
+          }
+          else {
+            list[i].rank = list[i-1].rank;
+            list[i].smt = list[i-1].smt + 1;
+          }
+        }
+        std::stable_sort(list.begin(), list.end(), [](const Cpu& a, const Cpu& b) {
+          if (a.smt != b.smt) return a.smt < b.smt;
+          if (a.rank != b.rank) return a.rank < b.rank;
+          return a.pkg < b.pkg;
+        });
+      }
+
+      for (size_t i = 0; i < list.size(); i++) cpus.push_back(list[i].id);
+    }
+
+  public:
+    Dispatcher(long n, int t, int policy)
+    {
+      nthreads = t;
+      ranges = new WorkRange[t];
+      for (int i = 0; i < t; i++) {
+        long begin = Align((n * i) / t);
+        long end = (i == t - 1) ? n : Align((n * (i + 1)) / t);
+        ranges[i].next.store(begin, std::memory_order_relaxed);
+        ranges[i].end = end;
+      }
+      BuildCpuOrder(policy);
+    }
+
+    ~Dispatcher()
+    {
+      delete[] ranges;
+    }
+
+    // Pin the calling thread to the CPU chosen for slot tid
+
+    void Pin(int tid)
+    {
+      if (cpus.empty()) return;
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpus[tid % cpus.size()], &set);
+      sched_setaffinity(0, sizeof(set), &set);
+    }
+
+    // Claim the next chunk for thread tid
+    // Returns false once every range is drained
+
+    bool Next(int tid, long* begin, long* end)
+    {
+      for (int k = 0; k < nthreads; k++) {
+        WorkRange* r = &ranges[(tid + k) % nthreads];
+        long b = r->next.fetch_add(DISPATCH_CHUNK, std::memory_order_relaxed);
+        if (b < r->end) {
+          *begin = b;
+          *end = std::min(b + DISPATCH_CHUNK, r->end);
+          return true;
+        }
+      }
+      return false;
+    }
+};
+
+// Shuffle the operation array so that every contiguous range sees the same
+// mix of adds, deletes and searches; a no-op without -DSHUFFLE_OPS
+
+template <typename T>
+void ShuffleOps(T* a, long n)
+{
+#ifdef SHUFFLE_OPS
+  for (long i = n - 1; i > 0; i--) {
+    long j = (long)((((unsigned long long)rand() << 31) ^ rand()) % (i + 1));
+    T t = a[i];
+    a[i] = a[j];
+    a[j] = t;
+  }
+#endif
+}
+
+#endif // DISPATCH_H
@@ -0,0 +1,25 @@
+// fingerprint.h
+//
+// Bucket filters of the hash tables.
+//
+// Each bucket keeps a 64-bit Bloom word over its keys, and every key sets two
+// of its bits. A lookup whose bits are not all set in the word returns false
+// without walking the bucket. How the word is kept up to date depends on the
+// table; see the comment on each table's bucket class.
+
+#ifndef FINGERPRINT_H
+#define FINGERPRINT_H
+
+#include <stdint.h>
+
+// Two bits of the 64-bit bucket filter for a key
+// Keys of one bucket differ in key / NUM_BUCKETS, which the multiply mixes
+// into the top bits
+
+inline uint64_t Fingerprint(unsigned long long key)
+{
+  uint64_t h = (uint64_t)key * 0x9E3779B97F4A7C15ULL;
+  return (1ULL << (h >> 58)) | (1ULL << ((h >> 52) & 63));
+}
+
+#endif // FINGERPRINT_H
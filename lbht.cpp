@@ -6,90 +6,390 @@
 #include "time.h"
 #include "omp.h"
 #include "sys/time.h"
+#include "assert.h"
+#include "hugepage.h"
+#include "fingerprint.h"
+#include "changes.h"
+#include "memstat.h"
+#include <new>
 #include <iostream>
+#include <sstream>
 #include <vector>
+#include <algorithm>
 
 // Constructor
 lbht_node::lbht_node(LL k) : key(k), next(NULL) {}
 
+// Chain nodes go on huge pages with -DHUGE_PAGES and are counted in the
+// memory statistics
+__thread HugeNodePool lbht_nodes;
+
+void *lbht_node::operator new(size_t size)
+{
+    MemAlloc(size);
+    return HugeNodeAlloc(&lbht_nodes, size);
+}
+
+void lbht_node::operator delete(void *p, size_t size)
+{
+    MemFree(size);
+    HugeNodeFree(&lbht_nodes, p);
+}
+
+#ifdef LBHT_FRONT
+// Front cache entry; tag holds the table serial above the result
+// (1 absent, 2 present), 0 for an empty entry
+struct lbht_front_entry
+{
+    LL key;
+    uint64_t epoch;
+    unsigned tag;
+};
+
+static __thread lbht_front_entry lbht_front[front_slots];
+static std::atomic<unsigned> lbht_serials(0);
+#endif
+
+// A change to a bucket holds the epoch of its stripe busy from before its
+// first store until before the bucket lock is released, so Contain cannot
+// answer from the front cache once any thread may have seen the change
+static inline void FrontBegin(lbht_epoch *epoch)
+{
+#ifdef LBHT_FRONT
+    if (epoch != NULL)
+        epoch->fetch_add(1, std::memory_order_acq_rel);
+#endif
+}
+
+static inline void FrontEnd(lbht_epoch *epoch)
+{
+#ifdef LBHT_FRONT
+    if (epoch != NULL)
+        epoch->fetch_add(front_done - 1, std::memory_order_release);
+#endif
+}
+
+// Scratch space of ApplyBatch, kept by each thread for its next batch
+struct lbht_batch_scratch
+{
+    lbht_batch_item *batch, *spare;
+    long capacity;
+};
+
+static __thread lbht_batch_scratch lbht_scratch;
+
+#ifdef LBHT_CACHE
+// Buckets of the CLOCK hand claimed by a thread for its sweeps
+struct lbht_sweep_claim
+{
+    const lbht *table;
+    unsigned next, end;
+};
+
+static __thread lbht_sweep_claim lbht_claim;
+
+static bool Expired(lbht_meta meta, lbht_meta now)
+{
+    return (meta & ~meta_ref) <= now;
+}
+#endif
+
 // lbht_list constructor
 lbht_list::lbht_list()
 {
-    head = new lbht_node(0);  // Initialize head with dummy value
     omp_init_lock(&listLock); // Initialize the lock
+    count = 0;
+    stale = 0;
+    filter.store(0, std::memory_order_relaxed);
+    chain = NULL;
+}
+
+// Set the filter bits of a key, called with the lock held
+void lbht_list::AddFingerprint(LL key)
+{
+    filter.store(filter.load(std::memory_order_relaxed) | Fingerprint(key), std::memory_order_release);
+}
+
+// Recompute the filter from the keys present, called with the lock held
+void lbht_list::RebuildFilter()
+{
+    uint64_t f = 0;
+    for (int i = 0; i < count; i++)
+        f |= Fingerprint(keys[i]);
+    for (lbht_node *curr = chain; curr != NULL; curr = curr->next)
+        f |= Fingerprint(curr->key);
+    filter.store(f, std::memory_order_release);
+    stale = 0;
+}
+
+// Put key at inline position i; a full header spills its largest key to the chain
+// Called with the lock held; in cache mode the caller sets meta[i]
+void lbht_list::InsertInline(int i, LL key)
+{
+    if (count == (int)inline_keys)
+    {
+        lbht_node *spill = new lbht_node(keys[count - 1]);
+#ifdef LBHT_CACHE
+        spill->meta = meta[count - 1];
+#endif
+        spill->next = chain;
+        chain = spill;
+        count--;
+    }
+    for (int j = count; j > i; j--)
+    {
+        keys[j] = keys[j - 1];
+#ifdef LBHT_CACHE
+        meta[j] = meta[j - 1];
+#endif
+    }
+    keys[i] = key;
+    count++;
+}
+
+// Remove inline key i, closing the gap and refilling the header from the chain
+// Called with the lock held
+void lbht_list::RemoveInline(int i)
+{
+    StageChange(CHANGE_DELETE, keys[i], ChangeSequence());
+    MemKeys(-1);
+    for (int j = i; j < count - 1; j++)
+    {
+        keys[j] = keys[j + 1];
+#ifdef LBHT_CACHE
+        meta[j] = meta[j + 1];
+#endif
+    }
+    count--;
+    if (chain != NULL)
+    {
+        lbht_node *first = chain;
+        keys[count] = first->key;
+#ifdef LBHT_CACHE
+        meta[count] = first->meta;
+#endif
+        count++;
+        chain = first->next;
+        delete first;
+    }
+    if (++stale >= filter_stale)
+        RebuildFilter();
+}
+
+// Unlink and free the chain node *link, called with the lock held
+void lbht_list::RemoveLink(lbht_node **link)
+{
+    lbht_node *curr = *link;
+    StageChange(CHANGE_DELETE, curr->key, ChangeSequence());
+    MemKeys(-1);
+    *link = curr->next;
+    delete curr;
+    if (++stale >= filter_stale)
+        RebuildFilter();
 }
 
 // lbht_list destructor
 lbht_list::~lbht_list()
 {
+    Clear();
     omp_destroy_lock(&listLock); // Destroy the lock
-    // Free list nodes
-    lbht_node *current = head;
+}
+
+// Drop every key; the list is ready for use again at once
+// The chain is detached under the lock and freed after it is released
+// Returns the number of keys dropped
+long lbht_list::Clear(lbht_epoch *epoch)
+{
+    omp_set_lock(&listLock); // Lock the list
+    long n = count;
+    lbht_node *current = chain;
+    bool changed = count > 0;
+    if (changed)
+        FrontBegin(epoch);
+    chain = NULL;
+    count = 0;
+    stale = 0;
+    filter.store(0, std::memory_order_release);
+    if (changed)
+        FrontEnd(epoch);
+    omp_unset_lock(&listLock); // Unlock the list
     while (current != NULL)
     {
         lbht_node *next = current->next;
         delete current;
         current = next;
+        n++;
     }
+    MemKeys(-n);
+    return n;
 }
 
 // Insert method for lbht_list
-bool lbht_list::Insert(LL key) {
+// In cache mode an expired entry counts as absent and is renewed in place
+#ifdef LBHT_CACHE
+bool lbht_list::Insert(LL key, lbht_cache_ctx &ctx, lbht_epoch *epoch) {
+#else
+bool lbht_list::Insert(LL key, lbht_epoch *epoch) {
+#endif
     omp_set_lock(&listLock); // Acquire lock
 
-    lbht_node* pred = head;
-    lbht_node* curr = head->next;
+    int i = 0;
+    while (i < count && keys[i] < key) i++;
 
-    // Traverse the list to find the insert location or existing key
-    while (curr != nullptr && curr->key < key) {
-        pred = curr;
-        curr = curr->next;
+    if (i < count && keys[i] == key) {
+#ifdef LBHT_CACHE
+        if (Expired(meta[i], ctx.now)) {
+            meta[i] = ctx.expiry;
+            StageChange(CHANGE_ADD, key, ChangeSequence());
+            omp_unset_lock(&listLock); // Release lock
+            return true;
+        }
+#endif
+        omp_unset_lock(&listLock); // Key found, release lock and return false
+        return false;
+    }
+
+    if (i < count || count < (int)inline_keys) {
+        // The key belongs in the header
+        FrontBegin(epoch);
+        InsertInline(i, key);
+#ifdef LBHT_CACHE
+        meta[i] = ctx.expiry;
+        ctx.size->fetch_add(1, std::memory_order_relaxed);
+#endif
+        AddFingerprint(key);
+        StageChange(CHANGE_ADD, key, ChangeSequence());
+        MemKeys(1);
+        FrontEnd(epoch);
+        omp_unset_lock(&listLock); // Release lock
+        return true;
+    }
+
+    // Traverse the chain to find the insert location or existing key
+    lbht_node** link = &chain;
+    while (*link != nullptr && (*link)->key < key) {
+        link = &(*link)->next;
     }
 
-    if (curr != nullptr && curr->key == key) {
+    if (*link != nullptr && (*link)->key == key) {
+#ifdef LBHT_CACHE
+        if (Expired((*link)->meta, ctx.now)) {
+            (*link)->meta = ctx.expiry;
+            StageChange(CHANGE_ADD, key, ChangeSequence());
+            omp_unset_lock(&listLock); // Release lock
+            return true;
+        }
+#endif
         omp_unset_lock(&listLock); // Key found, release lock and return false
         return false;
     } else {
         // Key not found, insert new node
         lbht_node* newNode = new lbht_node(key);
-        newNode->next = curr;
-        pred->next = newNode;
+        newNode->next = *link;
+#ifdef LBHT_CACHE
+        newNode->meta = ctx.expiry;
+        ctx.size->fetch_add(1, std::memory_order_relaxed);
+#endif
+        FrontBegin(epoch);
+        *link = newNode;
+        AddFingerprint(key);
+        StageChange(CHANGE_ADD, key, ChangeSequence());
+        MemKeys(1);
+        FrontEnd(epoch);
         omp_unset_lock(&listLock); // Release lock
         return true;
     }
 }
 
 // Delete method for lbht_list
-bool lbht_list::Delete(LL key)
+// In cache mode an expired entry is removed but reported as absent
+#ifdef LBHT_CACHE
+bool lbht_list::Delete(LL key, lbht_cache_ctx &ctx, lbht_epoch *epoch)
+#else
+bool lbht_list::Delete(LL key, lbht_epoch *epoch)
+#endif
 {
+    bool found = true;
     omp_set_lock(&listLock); // Lock the list
-    lbht_node *prev = head;
-    lbht_node *curr = head->next;
-    while (curr != NULL)
+    int i = 0;
+    while (i < count && keys[i] < key) i++;
+    if (i < count)
     {
-        if (curr->key == key)
+        if (keys[i] != key)
         {
-            prev->next = curr->next;
-            delete curr;
             omp_unset_lock(&listLock); // Unlock the list
-            return true;               // Key found and deleted
+            return false;              // Key not found
         }
-        prev = curr;
-        curr = curr->next;
+#ifdef LBHT_CACHE
+        found = !Expired(meta[i], ctx.now);
+        ctx.size->fetch_sub(1, std::memory_order_relaxed);
+#endif
+        FrontBegin(epoch);
+        RemoveInline(i);
+        FrontEnd(epoch);
+        omp_unset_lock(&listLock); // Unlock the list
+        return found;              // Key found and deleted
+    }
+    lbht_node **link = &chain;
+    while (*link != NULL && (*link)->key <= key)
+    {
+        if ((*link)->key == key)
+        {
+#ifdef LBHT_CACHE
+            found = !Expired((*link)->meta, ctx.now);
+            ctx.size->fetch_sub(1, std::memory_order_relaxed);
+#endif
+            FrontBegin(epoch);
+            RemoveLink(link);
+            FrontEnd(epoch);
+            omp_unset_lock(&listLock); // Unlock the list
+            return found;              // Key found and deleted
+        }
+        link = &(*link)->next;
     }
     omp_unset_lock(&listLock); // Unlock the list
     return false;              // Key not found
 }
 
 // Contain method for lbht_list
+// In cache mode a hit sets the reference bit of the entry
+#ifdef LBHT_CACHE
+bool lbht_list::Contain(LL key, lbht_cache_ctx &ctx)
+#else
 bool lbht_list::Contain(LL key)
+#endif
 {
+    uint64_t fp = Fingerprint(key);
+    if ((filter.load(std::memory_order_acquire) & fp) != fp)
+        return false; // Key cannot be present
     omp_set_lock(&listLock); // Lock the list
-    lbht_node *curr = head->next;
-    while (curr != NULL)
+    int i = 0;
+    while (i < count && keys[i] < key) i++;
+    if (i < count)
+    {
+        bool found = (keys[i] == key);
+#ifdef LBHT_CACHE
+        if (found && Expired(meta[i], ctx.now))
+            found = false;
+        else if (found)
+            meta[i] |= meta_ref;
+#endif
+        omp_unset_lock(&listLock); // Unlock the list
+        return found;
+    }
+    lbht_node *curr = chain;
+    while (curr != NULL && curr->key <= key)
     {
         if (curr->key == key)
         {
+#ifdef LBHT_CACHE
+            if (Expired(curr->meta, ctx.now))
+            {
+                omp_unset_lock(&listLock); // Unlock the list
+                return false;              // Key expired
+            }
+            curr->meta |= meta_ref;
+#endif
             omp_unset_lock(&listLock); // Unlock the list
             return true;               // Key found
         }
@@ -99,22 +399,473 @@ bool lbht_list::Contain(LL key)
     return false;              // Key not found
 }
 
+// Copy up to limit keys of the bucket to out in sorted order, or only count
+// them if out is NULL; in cache mode expired entries are left out
+// Returns the number of keys
+#ifdef LBHT_CACHE
+long lbht_list::Collect(LL *out, long limit, lbht_cache_ctx &ctx)
+#else
+long lbht_list::Collect(LL *out, long limit)
+#endif
+{
+    long n = 0;
+    omp_set_lock(&listLock); // Lock the list
+    for (int i = 0; i < count && n < limit; i++)
+    {
+#ifdef LBHT_CACHE
+        if (Expired(meta[i], ctx.now))
+            continue;
+#endif
+        if (out != NULL)
+            out[n] = keys[i];
+        n++;
+    }
+    for (lbht_node *curr = chain; curr != NULL && n < limit; curr = curr->next)
+    {
+#ifdef LBHT_CACHE
+        if (Expired(curr->meta, ctx.now))
+            continue;
+#endif
+        if (out != NULL)
+            out[n] = curr->key;
+        n++;
+    }
+    omp_unset_lock(&listLock); // Unlock the list
+    return n;
+}
+
+// Remove every key for which match returns true, under one hold of the lock
+// Survivors are compacted in place, the header is refilled from the chain and
+// the filter rebuilt once; returns the number of keys removed
+long lbht_list::EraseIf(lbht_pred match, void *arg, lbht_epoch *epoch)
+{
+    long removed = 0;
+    if (filter.load(std::memory_order_acquire) == 0)
+        return 0; // Bucket is empty
+    omp_set_lock(&listLock); // Lock the list
+    int kept = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (match(keys[i], arg))
+        {
+            if (removed == 0)
+                FrontBegin(epoch);
+            StageChange(CHANGE_DELETE, keys[i], ChangeSequence());
+            removed++;
+            continue;
+        }
+        keys[kept] = keys[i];
+#ifdef LBHT_CACHE
+        meta[kept] = meta[i];
+#endif
+        kept++;
+    }
+    count = kept;
+    lbht_node **link = &chain;
+    while (*link != NULL)
+    {
+        lbht_node *curr = *link;
+        if (match(curr->key, arg))
+        {
+            if (removed == 0)
+                FrontBegin(epoch);
+            StageChange(CHANGE_DELETE, curr->key, ChangeSequence());
+            *link = curr->next;
+            delete curr;
+            removed++;
+            continue;
+        }
+        link = &curr->next;
+    }
+    // Chain keys are larger than the header's, so they refill it in order
+    while (count < (int)inline_keys && chain != NULL)
+    {
+        lbht_node *first = chain;
+        keys[count] = first->key;
+#ifdef LBHT_CACHE
+        meta[count] = first->meta;
+#endif
+        count++;
+        chain = first->next;
+        delete first;
+    }
+    if (removed > 0)
+    {
+        RebuildFilter();
+        FrontEnd(epoch);
+    }
+    omp_unset_lock(&listLock); // Unlock the list
+    MemKeys(-removed);
+    return removed;
+}
+
+// Apply the items[0..m) of a batch under one hold of the lock
+// The items are in ascending key order, ops on one key in batch order; out[i]
+// gets the outcome of op i. Header keys are handled op by op, then the chain
+// is merged in one forward pass: once a key falls past a full header, so do
+// all larger ones. Returns the number of ops that changed the bucket
+#ifdef LBHT_CACHE
+long lbht_list::Apply(const LL *ops, const lbht_batch_item *items, long m, bool *out, lbht_cache_ctx &ctx, lbht_epoch *epoch)
+#else
+long lbht_list::Apply(const LL *ops, const lbht_batch_item *items, long m, bool *out, lbht_epoch *epoch)
+#endif
+{
+    long changed = 0;
+    omp_set_lock(&listLock); // Lock the list
+    lbht_node **link = &chain; // Chain cursor, only moves forward
+    for (long k = 0; k < m; k++)
+    {
+        long b = items[k].index;
+        LL key = items[k].key;
+        int i = 0;
+        while (i < count && keys[i] < key) i++;
+        bool inline_op = (i < count || count < (int)inline_keys);
+        if (!inline_op)
+            while (*link != NULL && (*link)->key < key)
+                link = &(*link)->next;
+        bool found = inline_op ? (i < count && keys[i] == key) : (*link != NULL && (*link)->key == key);
+#ifdef LBHT_CACHE
+        lbht_meta *meta_p = !found ? NULL : inline_op ? &meta[i] : &(*link)->meta;
+        bool live = found && !Expired(*meta_p, ctx.now);
+#else
+        bool live = found;
+#endif
+        if (ops[b] == INSERT)
+        {
+            out[b] = !live;
+            if (live)
+                continue;
+#ifdef LBHT_CACHE
+            if (found)
+            {
+                // An expired entry is renewed in place
+                *meta_p = ctx.expiry;
+                StageChange(CHANGE_ADD, key, ChangeSequence());
+                changed++;
+                continue;
+            }
+#endif
+            if (changed++ == 0)
+                FrontBegin(epoch);
+            if (inline_op)
+            {
+                InsertInline(i, key);
+#ifdef LBHT_CACHE
+                meta[i] = ctx.expiry;
+#endif
+                link = &chain; // The chain front may have changed
+            }
+            else
+            {
+                lbht_node *newNode = new lbht_node(key);
+                newNode->next = *link;
+#ifdef LBHT_CACHE
+                newNode->meta = ctx.expiry;
+#endif
+                *link = newNode;
+            }
+#ifdef LBHT_CACHE
+            ctx.size->fetch_add(1, std::memory_order_relaxed);
+#endif
+            AddFingerprint(key);
+            StageChange(CHANGE_ADD, key, ChangeSequence());
+            MemKeys(1);
+        }
+        else if (ops[b] == DELETE)
+        {
+            // In cache mode an expired entry is removed but reported as absent
+            out[b] = live;
+            if (!found)
+                continue;
+#ifdef LBHT_CACHE
+            ctx.size->fetch_sub(1, std::memory_order_relaxed);
+#endif
+            if (changed++ == 0)
+                FrontBegin(epoch);
+            if (inline_op)
+            {
+                RemoveInline(i);
+                link = &chain; // The chain front may have changed
+            }
+            else
+            {
+                RemoveLink(link);
+            }
+        }
+        else
+        {
+            out[b] = live;
+#ifdef LBHT_CACHE
+            if (live)
+                *meta_p |= meta_ref;
+#endif
+        }
+    }
+    if (changed > 0)
+        FrontEnd(epoch);
+    omp_unset_lock(&listLock); // Unlock the list
+    return changed;
+}
+
+#ifdef LBHT_CACHE
+// One CLOCK visit of the bucket
+// Expired entries are dropped, referenced entries get a second chance, and
+// with evict set unreferenced entries are dropped while the table is over capacity
+// Returns the number of entries dropped
+int lbht_list::Sweep(lbht_cache_ctx &ctx, bool evict)
+{
+    int removed = 0;
+    if (filter.load(std::memory_order_acquire) == 0)
+        return 0; // Bucket is empty
+    omp_set_lock(&listLock); // Lock the list
+    int i = 0;
+    while (i < count)
+    {
+        if (Expired(meta[i], ctx.now) ||
+            (evict && !(meta[i] & meta_ref) && ctx.size->load(std::memory_order_relaxed) > ctx.capacity))
+        {
+            ctx.size->fetch_sub(1, std::memory_order_relaxed);
+            RemoveInline(i);
+            removed++;
+            continue;
+        }
+        if (evict)
+            meta[i] &= ~meta_ref;
+        i++;
+    }
+    lbht_node **link = &chain;
+    while (*link != NULL)
+    {
+        lbht_node *curr = *link;
+        if (Expired(curr->meta, ctx.now) ||
+            (evict && !(curr->meta & meta_ref) && ctx.size->load(std::memory_order_relaxed) > ctx.capacity))
+        {
+            ctx.size->fetch_sub(1, std::memory_order_relaxed);
+            RemoveLink(link);
+            removed++;
+            continue;
+        }
+        if (evict)
+            curr->meta &= ~meta_ref;
+        link = &curr->next;
+    }
+    omp_unset_lock(&listLock); // Unlock the list
+    return removed;
+}
+#endif
+
+#ifdef LBHT_CACHE
 // lbht constructor
-lbht::lbht()
+// capacity bounds the number of entries, ttl_ms is their lifetime (0 for none)
+lbht::lbht(long capacity, unsigned ttl_ms)
+{
+    buckets = (lbht_list *)HugeAlloc(buckets_ct * sizeof(lbht_list));
+    MemAlloc(buckets_ct * sizeof(lbht_list));
+    for (int i = 0; i < buckets_ct; i++)
+        new (&buckets[i]) lbht_list();
+    this->capacity = capacity;
+    ttl = ttl_ms;
+    size.store(0);
+    hand.store(0);
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &start);
+}
+
+// Current tick and expiry for one call
+lbht_cache_ctx lbht::Context()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &t);
+    lbht_cache_ctx ctx;
+    ctx.now = (lbht_meta)((t.tv_sec - start.tv_sec) * 1000LL + (t.tv_nsec - start.tv_nsec) / 1000000);
+    ctx.expiry = ttl == 0 ? meta_never : ctx.now + ttl;
+    ctx.capacity = capacity;
+    ctx.size = &size;
+    return ctx;
+}
+
+// Next bucket for the calling thread to sweep
+// A thread claims evict_claim buckets from the hand at once and sweeps them
+// one by one, so an Insert touches the shared hand only every evict_claim calls
+unsigned lbht::NextSweep()
+{
+    lbht_sweep_claim &c = lbht_claim;
+    if (c.table != this || c.next == c.end)
+    {
+        c.table = this;
+        c.next = hand.fetch_add(evict_claim, std::memory_order_relaxed);
+        c.end = c.next + evict_claim;
+    }
+    return c.next++;
+}
+
+// Incremental upkeep, run by every Insert
+// Advances the CLOCK hand over a few buckets, so no caller pays for a full sweep
+void lbht::Maintain(lbht_cache_ctx &ctx)
 {
-    for (int i = 0; i < buckets_ct; ++i)
+    for (int k = 0; k < sweep_step; k++)
+        buckets[NextSweep() % buckets_ct].Sweep(ctx, false);
+    // The hand is claimed evict_claim buckets at a time to keep it off the hot path
+    int evicted = 0;
+    for (int k = 0; k < evict_scan && evicted < evict_step && size.load(std::memory_order_relaxed) > capacity; k += evict_claim)
     {
-        buckets[i] = new lbht_list();
+        unsigned b = hand.fetch_add(evict_claim, std::memory_order_relaxed);
+        for (int j = 0; j < evict_claim; j++)
+            evicted += buckets[(b + j) % buckets_ct].Sweep(ctx, true);
     }
+    PublishChanges();
 }
 
+// Number of entries, expired ones included until they are swept
+long lbht::Size()
+{
+    return size.load(std::memory_order_relaxed);
+}
+#else
+// lbht constructor
+lbht::lbht()
+{
+    buckets = (lbht_list *)HugeAlloc(buckets_ct * sizeof(lbht_list));
+    MemAlloc(buckets_ct * sizeof(lbht_list));
+    for (int i = 0; i < buckets_ct; i++)
+        new (&buckets[i]) lbht_list();
+#ifdef LBHT_FRONT
+    epochs = new lbht_epoch[front_stripes];
+    MemAlloc(front_stripes * sizeof(lbht_epoch));
+    for (int i = 0; i < front_stripes; i++)
+        epochs[i].store(0, std::memory_order_relaxed);
+    serial = lbht_serials.fetch_add(1) + 1;
+#endif
+}
+#endif
+
 // lbht destructor
 lbht::~lbht()
 {
-    for (int i = 0; i < buckets_ct; ++i)
+    for (int i = 0; i < buckets_ct; i++)
+        buckets[i].~lbht_list();
+    HugeFree(buckets, buckets_ct * sizeof(lbht_list));
+    MemFree(buckets_ct * sizeof(lbht_list));
+#ifdef LBHT_FRONT
+    delete[] epochs;
+    MemFree(front_stripes * sizeof(lbht_epoch));
+#endif
+}
+
+// Empty every bucket, in parallel; the table stays usable
+// The write-ahead log gets one record for the whole Clear
+void lbht::Clear()
+{
+    WalAppend(WAL_CLEAR, 0, ChangeSequence());
+#pragma omp parallel for schedule(static, 256)
+    for (int b = 0; b < buckets_ct; b++)
+    {
+#if defined(LBHT_CACHE)
+        size.fetch_sub(buckets[b].Clear(), std::memory_order_relaxed);
+#elif defined(LBHT_FRONT)
+        buckets[b].Clear(&epochs[b % front_stripes]);
+#else
+        buckets[b].Clear();
+#endif
+    }
+    WalSync();
+}
+
+// Remove every key for which match returns true, sweeping the buckets in
+// parallel and locking each once; match may be called from any thread
+// Concurrent operations see each bucket either before or after its sweep
+// Returns the number of keys removed; in cache mode expired entries count too
+long lbht::EraseIf(lbht_pred match, void *arg)
+{
+    long removed = 0;
+#pragma omp parallel for schedule(dynamic, 256) reduction(+ : removed)
+    for (int b = 0; b < buckets_ct; b++)
     {
-        delete buckets[i];
+#ifdef LBHT_FRONT
+        long n = buckets[b].EraseIf(match, arg, &epochs[b % front_stripes]);
+#else
+        long n = buckets[b].EraseIf(match, arg);
+#endif
+        PublishChanges();
+        removed += n;
     }
+#ifdef LBHT_CACHE
+    size.fetch_sub(removed, std::memory_order_relaxed);
+#endif
+    WalSync();
+    return removed;
+}
+
+// Apply n operations (INSERT, DELETE or CONTAIN), taking each bucket lock once
+// results[i] gets the outcome of op i. The batch is ordered by bucket and key,
+// so ops on different keys take effect in key order, ops on one key in batch
+// order. A stable radix sort groups the ops by bucket in a few linear passes,
+// and each run is then sorted by key, which keeps the batch order of equal keys
+// The sort works in scratch buffers that the calling thread reuses, so a
+// stream of batches does not allocate once the buffers are large enough
+void lbht::ApplyBatch(const LL *ops, const LL *keys, long n, bool *results)
+{
+#ifdef LBHT_CACHE
+    lbht_cache_ctx ctx = Context();
+#endif
+    lbht_batch_scratch &scratch = lbht_scratch;
+    if (n > scratch.capacity)
+    {
+        delete[] scratch.batch;
+        delete[] scratch.spare;
+        scratch.capacity = std::max(n, 2 * scratch.capacity);
+        scratch.batch = new lbht_batch_item[scratch.capacity];
+        scratch.spare = new lbht_batch_item[scratch.capacity];
+    }
+    lbht_batch_item *batch = scratch.batch, *spare = scratch.spare;
+    for (long i = 0; i < n; i++)
+        batch[i] = {Hash(keys[i]), keys[i], i};
+    for (int shift = 0; ((buckets_ct - 1) >> shift) != 0; shift += batch_radix)
+    {
+        long start[(1 << batch_radix) + 1] = {0};
+        for (long i = 0; i < n; i++)
+            start[((batch[i].bucket >> shift) & ((1 << batch_radix) - 1)) + 1]++;
+        for (int d = 0; d < (1 << batch_radix); d++)
+            start[d + 1] += start[d];
+        for (long i = 0; i < n; i++)
+            spare[start[(batch[i].bucket >> shift) & ((1 << batch_radix) - 1)]++] = batch[i];
+        std::swap(batch, spare);
+    }
+    for (long s = 0, e; s < n; s = e)
+    {
+        for (e = s + 1; e < n && batch[e].bucket == batch[s].bucket; e++);
+        if (e - s > batch_insertion)
+        {
+            std::stable_sort(batch + s, batch + e,
+                             [](const lbht_batch_item &a, const lbht_batch_item &b) { return a.key < b.key; });
+        }
+        else
+        {
+            for (long i = s + 1; i < e; i++)
+            {
+                lbht_batch_item item = batch[i];
+                long j = i;
+                for (; j > s && batch[j - 1].key > item.key; j--)
+                    batch[j] = batch[j - 1];
+                batch[j] = item;
+            }
+        }
+        LL index = batch[s].bucket;
+#if defined(LBHT_CACHE)
+        buckets[index].Apply(ops, &batch[s], e - s, results, ctx);
+#elif defined(LBHT_FRONT)
+        buckets[index].Apply(ops, &batch[s], e - s, results, &epochs[index % front_stripes]);
+#else
+        buckets[index].Apply(ops, &batch[s], e - s, results);
+#endif
+        PublishChanges();
+    }
+#ifdef LBHT_CACHE
+    // The upkeep every Insert would have run
+    for (long i = 0; i < n; i++)
+        if (ops[i] == INSERT)
+            Maintain(ctx);
+#endif
+    WalSync();
 }
 
 // Hash method for lbht
@@ -123,29 +874,235 @@ LL lbht::Hash(LL key)
     return key % buckets_ct;
 }
 
+#ifdef LBHT_CACHE
+// Insert method for lbht
+bool lbht::Insert(LL key)
+{
+    LL index = Hash(key);
+    lbht_cache_ctx ctx = Context();
+    bool inserted = buckets[index].Insert(key, ctx);
+    Maintain(ctx);
+    WalSync();
+    return inserted;
+}
+
+// Delete method for lbht
+bool lbht::Delete(LL key)
+{
+    LL index = Hash(key);
+    lbht_cache_ctx ctx = Context();
+    bool deleted = buckets[index].Delete(key, ctx);
+    PublishChanges();
+    WalSync();
+    return deleted;
+}
+
+// Contain method for lbht
+bool lbht::Contain(LL key)
+{
+    LL index = Hash(key);
+    lbht_cache_ctx ctx = Context();
+    bool found = buckets[index].Contain(key, ctx);
+    PublishChanges();
+    return found;
+}
+#elif defined(LBHT_FRONT)
+// Insert method for lbht
+bool lbht::Insert(LL key)
+{
+    LL index = Hash(key);
+    if (!buckets[index].Insert(key, &epochs[index % front_stripes]))
+        return false;
+    PublishChanges();
+    WalSync();
+    return true;
+}
+
+// Delete method for lbht
+bool lbht::Delete(LL key)
+{
+    LL index = Hash(key);
+    if (!buckets[index].Delete(key, &epochs[index % front_stripes]))
+        return false;
+    PublishChanges();
+    WalSync();
+    return true;
+}
+
+// Contain method for lbht
+// The front cache only answers while no change to the stripe is under way,
+// and a result is only cached if the epoch was quiet and unchanged across the
+// bucket read, so it reflects exactly the changes the epoch counts
+bool lbht::Contain(LL key)
+{
+    LL index = Hash(key);
+    lbht_epoch *epoch = &epochs[index % front_stripes];
+    uint64_t e = epoch->load(std::memory_order_acquire);
+    bool quiet = (e & front_busy) == 0;
+    lbht_front_entry *f = &lbht_front[(key * 0x9E3779B97F4A7C15ULL) >> (64 - front_bits)];
+    if (quiet && f->key == key && f->epoch == e && (f->tag >> 2) == serial)
+        return (f->tag & 3) == 2;
+    bool found = buckets[index].Contain(key);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (quiet && epoch->load(std::memory_order_relaxed) == e)
+    {
+        f->key = key;
+        f->epoch = e;
+        f->tag = (serial << 2) | (1 + found);
+    }
+    return found;
+}
+#else
 // Insert method for lbht
 bool lbht::Insert(LL key)
 {
     LL index = Hash(key);
-    return buckets[index]->Insert(key);
+    bool inserted = buckets[index].Insert(key);
+    PublishChanges();
+    WalSync();
+    return inserted;
 }
 
 // Delete method for lbht
 bool lbht::Delete(LL key)
 {
     LL index = Hash(key);
-    return buckets[index]->Delete(key);
+    bool deleted = buckets[index].Delete(key);
+    PublishChanges();
+    WalSync();
+    return deleted;
 }
 
 // Contain method for lbht
 bool lbht::Contain(LL key)
 {
     LL index = Hash(key);
-    return buckets[index]->Contain(key);
+    return buckets[index].Contain(key);
+}
+#endif
+
+// lbht_frozen constructor, room for n keys
+lbht_frozen::lbht_frozen(long n)
+{
+    size_t offsets = ((buckets_ct + 1) * sizeof(unsigned) + 63) & ~(size_t)63;
+    size_t bytes = (offsets + n * sizeof(LL) + 63) & ~(size_t)63;
+    block = aligned_alloc(64, bytes);
+    MemAlloc(bytes);
+    start = (unsigned *)block;
+    keys = (LL *)((char *)block + offsets);
+}
+
+// lbht_frozen destructor
+lbht_frozen::~lbht_frozen()
+{
+    size_t offsets = ((buckets_ct + 1) * sizeof(unsigned) + 63) & ~(size_t)63;
+    MemFree((offsets + Size() * sizeof(LL) + 63) & ~(size_t)63);
+    free(block);
+}
+
+// Lookup in the frozen table, safe from any number of threads
+bool lbht_frozen::Contain(LL key)
+{
+    LL b = key % buckets_ct;
+    for (unsigned i = start[b]; i < start[b + 1] && keys[i] <= key; i++)
+        if (keys[i] == key)
+            return true;
+    return false;
+}
+
+// Number of keys in the frozen table
+long lbht_frozen::Size()
+{
+    return start[buckets_ct];
+}
+
+// Build an immutable copy of the table
+// Buckets are counted in parallel, laid out by a prefix sum and then filled in
+// parallel. Writers must be quiescent; a bucket that grew between the passes
+// is cut off at its counted size
+lbht_frozen *lbht::Freeze()
+{
+#ifdef LBHT_CACHE
+    lbht_cache_ctx ctx = Context();
+#endif
+    unsigned *sizes = new unsigned[buckets_ct];
+#pragma omp parallel for schedule(static, 256)
+    for (int b = 0; b < buckets_ct; b++)
+    {
+#ifdef LBHT_CACHE
+        sizes[b] = buckets[b].Collect(NULL, 0x7fffffffL, ctx);
+#else
+        sizes[b] = buckets[b].Collect(NULL, 0x7fffffffL);
+#endif
+    }
+
+    long total = 0;
+    for (int b = 0; b < buckets_ct; b++)
+        total += sizes[b];
+    assert(total <= 0xffffffffL);
+
+    lbht_frozen *f = new lbht_frozen(total);
+    f->start[0] = 0;
+    for (int b = 0; b < buckets_ct; b++)
+        f->start[b + 1] = f->start[b] + sizes[b];
+
+#pragma omp parallel for schedule(static, 256)
+    for (int b = 0; b < buckets_ct; b++)
+    {
+        LL *out = f->keys + f->start[b];
+#ifdef LBHT_CACHE
+        long n = buckets[b].Collect(out, sizes[b], ctx);
+#else
+        long n = buckets[b].Collect(out, sizes[b]);
+#endif
+        // A bucket that shrank meanwhile is padded with a key of another bucket
+        for (; n < sizes[b]; n++)
+            out[n] = b + 1;
+    }
+    delete[] sizes;
+    return f;
+}
+
+#ifdef WAL
+// Write every key to a snapshot for Recover
+// Writers must be quiescent, as for Freeze, so that every change numbered up
+// to the recorded sequence number is in the keys and no later one
+bool lbht::Snapshot(const char *path)
+{
+    unsigned long long seq = WalSequence();
+    lbht_frozen *f = Freeze();
+    bool ok = WalSaveSnapshot(path, f->keys, f->Size(), seq);
+    delete f;
+    return ok;
+}
+
+static void lbht_replay(int op, unsigned long long key, void *arg)
+{
+    lbht *t = (lbht *)arg;
+    if (op == WAL_ADD)
+        t->Insert(key);
+    else if (op == WAL_DELETE)
+        t->Delete(key);
+    else
+        t->Clear();
+}
+
+// Rebuild an empty table from a snapshot (NULL for none) and the records of
+// the log after it. Run before WalOpen, so the replay is not logged again;
+// later changes are numbered above the replayed ones
+// Returns the number of log records applied, or -1 if a file cannot be read
+long lbht::Recover(const char *snapshot, const char *log)
+{
+    unsigned long long seq = 0;
+    if (snapshot != NULL && WalLoadSnapshot(snapshot, lbht_replay, this, &seq) < 0)
+        return -1;
+    return WalReplay(log, seq, lbht_replay, this);
 }
+#endif
 
+#ifndef LBHT_NO_MAIN
 int main() {
-    lbht_list list;  // Create an instance of lbht_list
+    lbht list;  // Create an instance of lbht
 
     const int NUM_KEYS = 5;
     LL duplicateKey = 5; // Define a test key to be inserted by all threads
@@ -171,6 +1128,12 @@ int main() {
     for (int i = 0; i < num_threads; ++i) {
         std::cout << thread_outputs[i].str();
     }
+#ifdef CHANGE_STREAM
+    // Nothing drains the stream here, so a full ring drops its records
+    std::cout << "change records dropped " << ChangeDrops() << std::endl;
+#endif
+    MemReport();
 
     return 0;
 }
+#endif // LBHT_NO_MAIN
@@ -1,14 +1,59 @@
 // lbht.h
+//
+// Compile with -DLBHT_CACHE for cache mode: entries carry an expiry time and a
+// CLOCK reference bit, and the table holds a bounded number of entries.
 
 #ifndef LBHT_H
 #define LBHT_H
 
 #include "omp.h"
+#include "stdint.h"
+#include "time.h"
+#include <atomic>
 
 typedef unsigned long long LL;
 
 #define buckets_ct 10000
 
+#ifdef LBHT_CACHE
+// Buckets each Insert sweeps for expired entries
+#define sweep_step 1
+// Entries each Insert evicts while the table is over capacity
+#define evict_step 2
+// Buckets each Insert may visit to find them
+#define evict_scan 64
+// Buckets taken from the CLOCK hand at once
+#define evict_claim 8
+// Entry metadata: expiry tick in the low 62 bits, CLOCK reference bit on top
+// A tick is a millisecond since the table was created, so it never reaches
+// meta_never, the expiry of entries that do not expire
+typedef uint64_t lbht_meta;
+#define meta_ref (1ULL << 63)
+#define meta_never (1ULL << 62)
+#endif
+
+// Compile with -DLBHT_FRONT for a per-thread front cache of Contain results.
+// An entry stays valid while the epoch of its bucket stripe is unchanged. A
+// change to a bucket counts itself into the epoch before its first store and
+// out again, moving the epoch on, before it releases the bucket lock; the
+// front cache is neither used nor filled while a change is under way.
+#ifdef LBHT_FRONT
+#ifdef LBHT_CACHE
+#error "the front cache would hide expiry and CLOCK references of cache mode"
+#endif
+// log2 of the direct-mapped entries per thread, 8 KB of them
+#define front_bits 9
+#define front_slots (1 << front_bits)
+// Epoch counters shared by the buckets
+#define front_stripes 4096
+// Epoch layout: changes under way in the low 16 bits, finished ones above
+#define front_busy 0xffffULL
+#define front_done (1ULL << 16)
+#endif
+
+// Epoch of a front cache stripe, passed to the bucket methods that change keys
+typedef std::atomic<uint64_t> lbht_epoch;
+
 #define INSERT (0)
 #define DELETE (1)
 #define CONTAIN (2)
@@ -18,40 +63,162 @@ LL *mthds;
 LL *outs;
 int keys_ct, threads_ct, keys_rg;
 
+// Predicate of lbht::EraseIf, called with the key and the caller's argument
+typedef bool (*lbht_pred)(LL key, void *arg);
+
+// Op of a batch, as ordered by lbht::ApplyBatch
+struct lbht_batch_item
+{
+    LL bucket;
+    LL key;
+    long index; // Position in the batch
+};
+
+// Bucket bits per radix pass of lbht::ApplyBatch
+#define batch_radix 7
+// Runs of one bucket up to this long are sorted by insertion
+#define batch_insertion 16
+
 class lbht_node
 {
 public:
     LL key;
     lbht_node *next;
+#ifdef LBHT_CACHE
+    lbht_meta meta; // Expiry tick and reference bit
+#endif
     lbht_node(LL k);
+    static void *operator new(size_t size);
+    static void operator delete(void *p, size_t size);
 };
 
-class lbht_list
+#ifdef LBHT_CACHE
+// Per-call cache state, filled in by lbht
+struct lbht_cache_ctx
+{
+    lbht_meta now;           // Current tick, in ms since the table was created
+    lbht_meta expiry;        // Expiry tick of entries inserted by this call
+    long capacity;           // Entries the table may hold
+    std::atomic<long> *size; // Entries the table holds
+};
+
+// Keys that fit in the cache line of a bucket header, with their metadata
+#define inline_keys ((64 - sizeof(omp_lock_t) - 2 * sizeof(short) - sizeof(uint64_t) - sizeof(lbht_node *)) / (sizeof(LL) + sizeof(lbht_meta)))
+#else
+// Keys that fit in the cache line of a bucket header
+#define inline_keys ((64 - sizeof(omp_lock_t) - 2 * sizeof(short) - sizeof(uint64_t) - sizeof(lbht_node *)) / sizeof(LL))
+#endif
+
+// Deletes after which a bucket filter is rebuilt
+#define filter_stale 8
+
+// Bucket header, stored inline in the bucket array and padded to a cache line
+// Holds the smallest keys of the bucket; the rest go to a sorted chain
+// The filter is a Bloom word over the keys, checked by Contain without the lock
+class __attribute__((aligned(64))) lbht_list
 {
 private:
-    lbht_node *head;
     omp_lock_t listLock;
+    unsigned short count;         // Number of keys held inline
+    unsigned short stale;         // Deletes since the filter was rebuilt
+    std::atomic<uint64_t> filter; // Superset of the fingerprints of the keys
+    LL keys[inline_keys];         // Inline keys, sorted
+#ifdef LBHT_CACHE
+    lbht_meta meta[inline_keys];  // Metadata of the inline keys
+#endif
+    lbht_node *chain;             // Overflow chain, sorted, all larger than keys[]
+
+    void AddFingerprint(LL key);
+    void RebuildFilter();
+    void InsertInline(int i, LL key);
+    void RemoveInline(int i);
+    void RemoveLink(lbht_node **link);
 
 public:
     lbht_list();
     ~lbht_list();
-    bool Insert(LL key);
-    bool Delete(LL key);
+#ifdef LBHT_CACHE
+    bool Insert(LL key, lbht_cache_ctx &ctx, lbht_epoch *epoch = NULL);
+    bool Delete(LL key, lbht_cache_ctx &ctx, lbht_epoch *epoch = NULL);
+    bool Contain(LL key, lbht_cache_ctx &ctx);
+    int Sweep(lbht_cache_ctx &ctx, bool evict);
+    long Collect(LL *out, long limit, lbht_cache_ctx &ctx);
+    long Apply(const LL *ops, const lbht_batch_item *items, long m, bool *out, lbht_cache_ctx &ctx, lbht_epoch *epoch = NULL);
+    long Clear(lbht_epoch *epoch = NULL);
+#else
+    bool Insert(LL key, lbht_epoch *epoch = NULL);
+    bool Delete(LL key, lbht_epoch *epoch = NULL);
+    bool Contain(LL key);
+    long Collect(LL *out, long limit);
+    long Apply(const LL *ops, const lbht_batch_item *items, long m, bool *out, lbht_epoch *epoch = NULL);
+    long Clear(lbht_epoch *epoch = NULL);
+#endif
+    long EraseIf(lbht_pred match, void *arg, lbht_epoch *epoch = NULL);
+};
+
+static_assert(sizeof(lbht_list) == 64, "bucket header must fill exactly one cache line");
+
+// Immutable snapshot of an lbht, built by lbht::Freeze
+// One allocation holds the bucket offsets followed by the keys of every bucket,
+// sorted, so a lookup reads one offset pair and one short run of keys, without
+// locks or atomics
+class lbht_frozen
+{
+private:
+    unsigned *start; // start[b] .. start[b + 1] index the keys of bucket b
+    LL *keys;
+    void *block;
+
+    friend class lbht;
+    lbht_frozen(long n);
+
+public:
+    ~lbht_frozen();
     bool Contain(LL key);
+    long Size();
 };
 
 class lbht
 {
 private:
-    lbht_list *buckets[buckets_ct];
+    lbht_list *buckets; // Bucket headers, one contiguous array
     LL Hash(LL key);
 
+#ifdef LBHT_FRONT
+    lbht_epoch *epochs;            // Epoch of each bucket stripe
+    unsigned serial;               // Tells the tables apart in the front cache
+#endif
+
+#ifdef LBHT_CACHE
+    long capacity;               // Entries the table may hold
+    unsigned ttl;                // Lifetime of an entry in ms, 0 for no expiry
+    std::atomic<long> size;      // Entries the table holds
+    std::atomic<unsigned> hand;  // Next bucket for the CLOCK sweep
+    struct timespec start;       // Time of tick 0
+    lbht_cache_ctx Context();
+    unsigned NextSweep();
+    void Maintain(lbht_cache_ctx &ctx);
+#endif
+
 public:
+#ifdef LBHT_CACHE
+    lbht(long capacity = 0x7fffffffffffffffL, unsigned ttl_ms = 0);
+    long Size();
+#else
     lbht();
+#endif
     ~lbht();
     bool Insert(LL key);
     bool Delete(LL key);
     bool Contain(LL key);
+    void Clear();
+    long EraseIf(lbht_pred match, void *arg);
+    void ApplyBatch(const LL *ops, const LL *keys, long n, bool *results);
+    lbht_frozen *Freeze();
+#ifdef WAL
+    bool Snapshot(const char *path);
+    long Recover(const char *snapshot, const char *log);
+#endif
 };
 
 #endif // LBHT_H
@@ -0,0 +1,198 @@
+// lbht_client.cpp
+//
+// Load generator for lbht_server. Each thread opens one connection and keeps
+// sending pipelined batches of requests: it writes depth requests, reads the
+// depth responses and records the round trip of the batch. At the end it
+// prints requests per second and the 50th, 99th and 99.9th percentile batch
+// latency in microseconds.
+//
+// Compile: g++ -O3 -pthread -o lbht_client lbht_client.cpp
+// Run:     ./lbht_client [-p port | -u path] [-c connections] [-d depth]
+//                        [-s seconds] [-k keys] [-a adds] [-r deletes]
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "time.h"
+#include "unistd.h"
+#include "pthread.h"
+#include "sys/socket.h"
+#include "sys/un.h"
+#include "netinet/in.h"
+#include "netinet/tcp.h"
+#include "arpa/inet.h"
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+typedef unsigned long long LL;
+
+static int port = 11311;
+static const char *unix_path = NULL;
+static int conns = 4;
+static int depth = 32;
+static int seconds = 5;
+static LL keys_rg = 100000;
+static int adds = 10, deletes = 10;
+
+static std::atomic<bool> stop(false);
+
+struct client_stats
+{
+    LL requests;
+    std::vector<unsigned> latency; // Batch round trips in microseconds
+};
+
+static double Now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int Connect()
+{
+    int fd;
+    if (unix_path != NULL)
+    {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, unix_path, sizeof(addr.sun_path) - 1);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+            fd = -1;
+    }
+    else
+    {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+            fd = -1;
+    }
+    if (fd < 0)
+    {
+        perror("connect");
+        exit(1);
+    }
+    return fd;
+}
+
+static void *Run(void *arg)
+{
+    client_stats *st = (client_stats *)arg;
+    int fd = Connect();
+    unsigned seed = (unsigned)(size_t)st;
+    std::vector<char> out(depth * 32), in(depth * 16 + 1);
+
+    while (!stop.load(std::memory_order_relaxed))
+    {
+        size_t len = 0;
+        for (int i = 0; i < depth; i++)
+        {
+            int r = rand_r(&seed) % 100;
+            const char *cmd = r < adds ? "set" : (r < adds + deletes ? "delete" : "get");
+            LL key = 10 + rand_r(&seed) % keys_rg;
+            len += sprintf(&out[len], "%s %llu\r\n", cmd, key);
+        }
+
+        double t0 = Now();
+        for (size_t w = 0; w < len;)
+        {
+            ssize_t n = write(fd, &out[w], len - w);
+            if (n <= 0)
+                return NULL;
+            w += n;
+        }
+        // Every response ends in a single \n
+        int seen = 0;
+        while (seen < depth)
+        {
+            ssize_t n = read(fd, &in[0], in.size());
+            if (n <= 0)
+                return NULL;
+            for (ssize_t i = 0; i < n; i++)
+                seen += in[i] == '\n';
+        }
+        st->latency.push_back((unsigned)((Now() - t0) * 1e6));
+        st->requests += depth;
+    }
+    close(fd);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "p:u:c:d:s:k:a:r:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'u':
+            unix_path = optarg;
+            break;
+        case 'c':
+            conns = atoi(optarg);
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        case 's':
+            seconds = atoi(optarg);
+            break;
+        case 'k':
+            keys_rg = atoll(optarg);
+            break;
+        case 'a':
+            adds = atoi(optarg);
+            break;
+        case 'r':
+            deletes = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-p port | -u path] [-c connections] [-d depth] [-s seconds] [-k keys] [-a adds] [-r deletes]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    std::vector<client_stats> stats(conns);
+    std::vector<pthread_t> threads(conns);
+    double t0 = Now();
+    for (int t = 0; t < conns; t++)
+    {
+        stats[t].requests = 0;
+        pthread_create(&threads[t], NULL, Run, &stats[t]);
+    }
+    sleep(seconds);
+    stop.store(true);
+    for (int t = 0; t < conns; t++)
+        pthread_join(threads[t], NULL);
+    double elapsed = Now() - t0;
+
+    LL requests = 0;
+    std::vector<unsigned> all;
+    for (int t = 0; t < conns; t++)
+    {
+        requests += stats[t].requests;
+        all.insert(all.end(), stats[t].latency.begin(), stats[t].latency.end());
+    }
+    if (all.empty())
+    {
+        printf("No batch completed.\n");
+        return 1;
+    }
+    std::sort(all.begin(), all.end());
+    printf("requests/s %lf\n", requests / elapsed);
+    printf("batch latency us p50 %u p99 %u p99.9 %u\n",
+           all[all.size() / 2], all[all.size() * 99 / 100], all[all.size() * 999 / 1000]);
+    return 0;
+}
@@ -0,0 +1,357 @@
+// lbht_server.cpp
+//
+// Network front-end for lbht. Serves a memcached-style text protocol over TCP
+// or a Unix socket:
+//
+//     set <key>\r\n     ->  STORED | NOT_STORED
+//     get <key>\r\n     ->  FOUND | NOT_FOUND
+//     delete <key>\r\n  ->  DELETED | NOT_FOUND
+//
+// Anything else gets ERROR. Clients may pipeline requests. Each event loop
+// thread has its own epoll instance and its own listening socket (SO_REUSEPORT
+// for TCP; a shared socket with EPOLLEXCLUSIVE for Unix sockets) and is pinned
+// to a CPU with the compact policy of dispatch.h (-a 2 for scatter, -a 0 for
+// none), so connections stay on the core that accepted them. A loop parses
+// every complete request in the read buffer into one batch, runs it through
+// lbht::ApplyBatch, which takes each bucket lock once per batch, and answers
+// it with a single writev of the static response strings.
+//
+// Compile: g++ -O3 -fopenmp -o lbht_server lbht_server.cpp
+// Run:     ./lbht_server [-p port | -u path] [-t threads] [-a policy]
+
+#define LBHT_NO_MAIN
+#include "lbht.cpp"
+#include "dispatch.h"
+#include "string.h"
+#include "errno.h"
+#include "fcntl.h"
+#include "unistd.h"
+#include "pthread.h"
+#include "signal.h"
+#include "sys/epoll.h"
+#include "sys/socket.h"
+#include "sys/uio.h"
+#include "sys/un.h"
+#include "netinet/in.h"
+#include "netinet/tcp.h"
+#include "arpa/inet.h"
+#include <string>
+
+// Bytes read from a connection at once
+#define read_size 65536
+// Requests answered by one writev
+#define batch_max 1024
+// Events handled per epoll_wait
+#define events_max 256
+
+static const char rsp_stored[] = "STORED\r\n";
+static const char rsp_not_stored[] = "NOT_STORED\r\n";
+static const char rsp_found[] = "FOUND\r\n";
+static const char rsp_not_found[] = "NOT_FOUND\r\n";
+static const char rsp_deleted[] = "DELETED\r\n";
+static const char rsp_error[] = "ERROR\r\n";
+
+struct server_conn
+{
+    int fd;
+    size_t used;            // Bytes of unparsed input in in[]
+    std::string pending;    // Output a short writev left behind
+    char in[read_size];
+};
+
+static lbht table;
+static int port = 11311;
+static const char *unix_path = NULL;
+static int unix_fd = -1;
+static Dispatcher *dispatcher; // Pins the event loops
+
+static void SetNonBlocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+static int Listen()
+{
+    if (unix_path != NULL)
+        return unix_fd;
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 1024) != 0)
+    {
+        perror("listen");
+        exit(1);
+    }
+    SetNonBlocking(fd);
+    return fd;
+}
+
+// Parse one request line, without its terminator, into an lbht batch op and
+// its key; returns -1 for a malformed request
+// The key must be all decimal digits and fit in 64 bits
+static int Parse(char *line, char *end, LL *key)
+{
+    char *p = line;
+    while (p < end && *p != ' ')
+        p++;
+    size_t n = p - line;
+    if (p == end)
+        return -1;
+    if (p + 1 == end || p[1] < '0' || p[1] > '9')
+        return -1; // strtoull would take a sign or leading blanks
+    *end = '\0';
+    char *stop;
+    errno = 0;
+    *key = strtoull(p + 1, &stop, 10);
+    if (stop != end || errno == ERANGE)
+        return -1;
+
+    if (n == 3 && memcmp(line, "set", 3) == 0)
+        return INSERT;
+    if (n == 3 && memcmp(line, "get", 3) == 0)
+        return CONTAIN;
+    if (n == 6 && memcmp(line, "delete", 6) == 0)
+        return DELETE;
+    return -1;
+}
+
+// The response to a request given its op and outcome
+static const char *Response(int op, bool result)
+{
+    switch (op)
+    {
+    case INSERT:
+        return result ? rsp_stored : rsp_not_stored;
+    case CONTAIN:
+        return result ? rsp_found : rsp_not_found;
+    case DELETE:
+        return result ? rsp_deleted : rsp_not_found;
+    }
+    return rsp_error;
+}
+
+// Write the responses of a batch; whatever the socket does not take is kept
+// in pending and the connection waits for EPOLLOUT
+static bool Respond(server_conn *c, struct iovec *iov, int n)
+{
+    size_t total = 0;
+    for (int i = 0; i < n; i++)
+        total += iov[i].iov_len;
+    ssize_t w;
+    do
+        w = writev(c->fd, iov, n);
+    while (w < 0 && errno == EINTR);
+    if (w < 0)
+    {
+        if (errno != EAGAIN)
+            return false;
+        w = 0;
+    }
+    if ((size_t)w == total)
+        return true;
+    for (int i = 0; i < n; i++)
+    {
+        if ((size_t)w >= iov[i].iov_len)
+        {
+            w -= iov[i].iov_len;
+            continue;
+        }
+        c->pending.append((const char *)iov[i].iov_base + w, iov[i].iov_len - w);
+        w = 0;
+    }
+    return true;
+}
+
+// Parse and answer every complete request in the input buffer, batch by batch
+static bool Serve(server_conn *c)
+{
+    struct iovec iov[batch_max];
+    int kinds[batch_max];
+    LL ops[batch_max], keys[batch_max];
+    bool results[batch_max];
+    size_t pos = 0;
+    while (c->pending.empty())
+    {
+        int n = 0, m = 0; // Requests, well-formed requests
+        while (n < batch_max)
+        {
+            char *line = c->in + pos;
+            char *nl = (char *)memchr(line, '\n', c->used - pos);
+            if (nl == NULL)
+                break;
+            char *end = (nl > line && nl[-1] == '\r') ? nl - 1 : nl;
+            kinds[n] = Parse(line, end, &keys[m]);
+            if (kinds[n] >= 0)
+                ops[m++] = kinds[n];
+            n++;
+            pos = nl + 1 - c->in;
+        }
+        if (n == 0)
+            break;
+        // Requests on one key keep their pipelined order
+        table.ApplyBatch(ops, keys, m, results);
+        for (int i = 0, j = 0; i < n; i++)
+        {
+            const char *rsp = kinds[i] >= 0 ? Response(kinds[i], results[j++]) : rsp_error;
+            iov[i].iov_base = (void *)rsp;
+            iov[i].iov_len = strlen(rsp);
+        }
+        if (!Respond(c, iov, n))
+            return false;
+    }
+    memmove(c->in, c->in + pos, c->used - pos);
+    c->used -= pos;
+    if (c->used == read_size && c->pending.empty())
+        return false; // A request longer than the buffer
+    return true;
+}
+
+// Flush pending output; returns false on a dead connection
+static bool Flush(server_conn *c)
+{
+    while (!c->pending.empty())
+    {
+        ssize_t w = write(c->fd, c->pending.data(), c->pending.size());
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w < 0)
+            return errno == EAGAIN;
+        c->pending.erase(0, w);
+    }
+    return true;
+}
+
+static void Close(int ep, server_conn *c)
+{
+    epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    delete c;
+}
+
+// Event loop of one thread
+static void *Loop(void *arg)
+{
+    dispatcher->Pin((int)(long)arg);
+    int lfd = Listen();
+    int ep = epoll_create1(0);
+    struct epoll_event ev;
+    ev.events = EPOLLIN | (unix_path != NULL ? EPOLLEXCLUSIVE : 0);
+    ev.data.ptr = NULL;
+    epoll_ctl(ep, EPOLL_CTL_ADD, lfd, &ev);
+
+    struct epoll_event events[events_max];
+    while (true)
+    {
+        int n = epoll_wait(ep, events, events_max, -1);
+        for (int i = 0; i < n; i++)
+        {
+            server_conn *c = (server_conn *)events[i].data.ptr;
+            if (c == NULL)
+            {
+                int fd;
+                while ((fd = accept(lfd, NULL, NULL)) >= 0)
+                {
+                    int one = 1;
+                    SetNonBlocking(fd);
+                    if (unix_path == NULL)
+                        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                    c = new server_conn;
+                    c->fd = fd;
+                    c->used = 0;
+                    ev.events = EPOLLIN | EPOLLRDHUP;
+                    ev.data.ptr = c;
+                    epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+                }
+                continue;
+            }
+
+            bool alive = true;
+            if (events[i].events & EPOLLOUT)
+            {
+                alive = Flush(c) && Serve(c);
+            }
+            while (alive && c->pending.empty())
+            {
+                ssize_t r = read(c->fd, c->in + c->used, read_size - c->used);
+                if (r < 0 && errno == EINTR)
+                    continue; // Interrupted by a signal, not a dead peer
+                if (r == 0 || (r < 0 && errno != EAGAIN))
+                    alive = false;
+                if (r <= 0)
+                    break;
+                c->used += r;
+                alive = Serve(c);
+            }
+            if (!alive)
+            {
+                Close(ep, c);
+                continue;
+            }
+            // Stop reading while output is backed up
+            ev.events = c->pending.empty() ? (EPOLLIN | EPOLLRDHUP) : EPOLLOUT;
+            ev.data.ptr = c;
+            epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    int affinity = AFFINITY_COMPACT;
+    while ((opt = getopt(argc, argv, "p:u:t:a:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'u':
+            unix_path = optarg;
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'a':
+            affinity = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-p port | -u path] [-t threads] [-a policy]\n", argv[0]);
+            exit(1);
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    if (unix_path != NULL)
+    {
+        unix_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, unix_path, sizeof(addr.sun_path) - 1);
+        unlink(unix_path);
+        if (bind(unix_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(unix_fd, 1024) != 0)
+        {
+            perror("listen");
+            exit(1);
+        }
+        SetNonBlocking(unix_fd);
+    }
+
+    dispatcher = new Dispatcher(0, threads, affinity);
+    std::vector<pthread_t> loops(threads);
+    for (int t = 0; t < threads; t++)
+        pthread_create(&loops[t], NULL, Loop, (void *)(long)t);
+    for (int t = 0; t < threads; t++)
+        pthread_join(loops[t], NULL);
+    return 0;
+}
@@ -0,0 +1,144 @@
+// memstat.h
+//
+// Memory accounting for the tables. Compile with -DMEM_STATS to enable.
+//
+// Each thread counts into its own block, so a count costs one add to a line
+// no other thread writes; MemQuery sums the blocks at any time, and
+// MemReport prints the totals after the run time. Counters are per process,
+// which holds one table in every harness. Bytes are the sizes the tables ask
+// for; allocator headers and rounding are not included.
+//
+//   live      bytes of bucket arrays, sentinels, nodes and arena chunks held
+//   keys      keys in the table
+//   retired   bytes of nodes unlinked but not yet freed or reused, part of live
+//   reserved  bytes of arena chunks, part of live
+//   carved    bytes of arena chunks handed out as nodes; reserved - carved is
+//             the unused tail of the chunks
+//
+// Without the flag the counting functions are empty and compile away.
+
+#ifndef MEMSTAT_H
+#define MEMSTAT_H
+
+#include "stdio.h"
+#include <atomic>
+
+struct MemStats
+{
+  long live;
+  long keys;
+  long retired;
+  long reserved;
+  long carved;
+};
+
+#ifdef MEM_STATS
+
+// Counters of one thread; only the owner writes them
+class MemBlock
+{
+public:
+  std::atomic<long> live, keys, retired, reserved, carved;
+  MemBlock* link;   // Next block in the registry
+
+  MemBlock()
+  {
+    live.store(0, std::memory_order_relaxed);
+    keys.store(0, std::memory_order_relaxed);
+    retired.store(0, std::memory_order_relaxed);
+    reserved.store(0, std::memory_order_relaxed);
+    carved.store(0, std::memory_order_relaxed);
+    link = NULL;
+  }
+};
+
+std::atomic<MemBlock*> memBlocks(NULL);   // Every block ever created
+__thread MemBlock* myMem;
+
+// The block of the calling thread, created on first use; blocks are never freed
+inline MemBlock* Mem()
+{
+  if (myMem == NULL) {
+    MemBlock* b = new MemBlock();
+    b->link = memBlocks.load(std::memory_order_relaxed);
+    while (!memBlocks.compare_exchange_weak(b->link, b, std::memory_order_release, std::memory_order_relaxed));
+    myMem = b;
+  }
+  return myMem;
+}
+
+// Owner-only add, without a locked instruction
+inline void MemAdd(std::atomic<long>& c, long v)
+{
+  c.store(c.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+}
+
+inline void MemAlloc(long bytes)    { MemAdd(Mem()->live, bytes); }
+inline void MemFree(long bytes)     { MemAdd(Mem()->live, -bytes); }
+inline void MemKeys(long n)         { MemAdd(Mem()->keys, n); }
+inline void MemRetire(long bytes)   { MemAdd(Mem()->retired, bytes); }
+inline void MemReclaim(long bytes)  { MemAdd(Mem()->retired, -bytes); }
+inline void MemCarve(long bytes)    { MemAdd(Mem()->carved, bytes); }
+
+// An arena chunk taken or given back; carved is what it had handed out
+inline void MemReserve(long bytes)
+{
+  MemAdd(Mem()->live, bytes);
+  MemAdd(Mem()->reserved, bytes);
+}
+
+inline void MemUnreserve(long bytes, long carved)
+{
+  MemAdd(Mem()->live, -bytes);
+  MemAdd(Mem()->reserved, -bytes);
+  MemAdd(Mem()->carved, -carved);
+}
+
+// Totals over all threads; exact when no thread is counting
+inline MemStats MemQuery()
+{
+  MemStats s = { 0, 0, 0, 0, 0 };
+  for (MemBlock* b = memBlocks.load(std::memory_order_acquire); b != NULL; b = b->link) {
+    s.live += b->live.load(std::memory_order_relaxed);
+    s.keys += b->keys.load(std::memory_order_relaxed);
+    s.retired += b->retired.load(std::memory_order_relaxed);
+    s.reserved += b->reserved.load(std::memory_order_relaxed);
+    s.carved += b->carved.load(std::memory_order_relaxed);
+  }
+  return s;
+}
+
+inline void MemReport()
+{
+  MemStats s = MemQuery();
+  printf("memory live %ld B keys %ld B/key %.1lf retired %ld B", s.live, s.keys,
+         s.keys > 0 ? (double)s.live / s.keys : 0.0, s.retired);
+  if (s.reserved > 0)
+    printf(" arena unused %ld B (%.1lf%%)", s.reserved - s.carved, 100.0 * (s.reserved - s.carved) / s.reserved);
+  printf("\n");
+}
+
+#else
+
+inline void MemAlloc(long bytes) {}
+inline void MemFree(long bytes) {}
+inline void MemKeys(long n) {}
+inline void MemRetire(long bytes) {}
+inline void MemReclaim(long bytes) {}
+inline void MemCarve(long bytes) {}
+inline void MemReserve(long bytes) {}
+inline void MemUnreserve(long bytes, long carved) {}
+
+inline MemStats MemQuery()
+{
+  MemStats s = { 0, 0, 0, 0, 0 };
+  return s;
+}
+
+inline void MemReport()
+{
+}
+
+#endif // MEM_STATS
+
+#endif // MEMSTAT_H
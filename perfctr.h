@@ -0,0 +1,179 @@
+// perfctr.h
+//
+// Optional hardware performance counters for the benchmark harnesses.
+//
+// Compile with -DPERF_COUNTERS to enable. Each worker thread opens one
+// perf_event_open group for itself, enables it just before it starts on the
+// operation sequence and disables it right after, so only the timed region is
+// counted. The per-thread counts are summed and printed per operation after
+// the run time. Events the kernel or the hardware does not support are left
+// out of the group and reported as unavailable.
+
+#ifndef PERFCTR_H
+#define PERFCTR_H
+
+#include "stdio.h"
+#include "string.h"
+#include "unistd.h"
+#include "sys/ioctl.h"
+#include "sys/syscall.h"
+#include "linux/perf_event.h"
+#include <atomic>
+
+// Counted events
+#define PERF_CYCLES (0)
+#define PERF_CACHE_MISSES (1)
+#define PERF_LLC_MISSES (2)
+#define PERF_BRANCH_MISSES (3)
+#define PERF_DTLB_MISSES (4)
+#define PERF_STALLED_CYCLES (5)
+#define PERF_EVENTS (6)
+
+static const char* perfNames[PERF_EVENTS] = {
+  "cycles", "cache-misses", "LLC-load-misses", "branch-misses", "dTLB-load-misses", "stalled-cycles-backend"
+};
+
+// Totals over all threads
+
+class PerfTotals
+{
+  public:
+    std::atomic<unsigned long long> count[PERF_EVENTS];
+    std::atomic<int> present[PERF_EVENTS];     // Threads that counted the event
+
+    PerfTotals()
+    {
+      for (int e = 0; e < PERF_EVENTS; e++) {
+        count[e].store(0);
+        present[e].store(0);
+      }
+    }
+
+    // Print counts per operation, one event per line
+
+    void Report(long ops)
+    {
+      for (int e = 0; e < PERF_EVENTS; e++) {
+        if (present[e].load() == 0)
+          printf("%s/op unavailable\n", perfNames[e]);
+        else
+          printf("%s/op %lf\n", perfNames[e], (double)count[e].load() / ops);
+      }
+    }
+};
+
+// Counter group of the calling thread
+
+class PerfGroup
+{
+  private:
+    int fd[PERF_EVENTS];
+    unsigned long long id[PERF_EVENTS];
+    int leader;
+
+    static void Describe(int e, struct perf_event_attr* attr)
+    {
+      memset(attr, 0, sizeof(*attr));
+      attr->size = sizeof(*attr);
+      attr->type = PERF_TYPE_HARDWARE;
+      switch (e) {
+        case PERF_CYCLES:
+          attr->config = PERF_COUNT_HW_CPU_CYCLES;
+          break;
+        case PERF_CACHE_MISSES:
+          attr->config = PERF_COUNT_HW_CACHE_MISSES;
+          break;
+        case PERF_LLC_MISSES:
+          attr->type = PERF_TYPE_HW_CACHE;
+          attr->config = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+          break;
+        case PERF_BRANCH_MISSES:
+          attr->config = PERF_COUNT_HW_BRANCH_MISSES;
+          break;
+        case PERF_DTLB_MISSES:
+          attr->type = PERF_TYPE_HW_CACHE;
+          attr->config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+          break;
+        case PERF_STALLED_CYCLES:
+          attr->config = PERF_COUNT_HW_STALLED_CYCLES_BACKEND;
+          break;
+      }
+      attr->disabled = 1;
+      attr->exclude_kernel = 1;
+      attr->exclude_hv = 1;
+      attr->read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID |
+                          PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    }
+
+  public:
+    PerfGroup()
+    {
+      leader = -1;
+      for (int e = 0; e < PERF_EVENTS; e++) fd[e] = -1;
+    }
+
+    ~PerfGroup()
+    {
+      Close();
+    }
+
+    // Open the group for the calling thread on whichever CPU it runs
+
+    void Open()
+    {
+      struct perf_event_attr attr;
+      for (int e = 0; e < PERF_EVENTS; e++) {
+        Describe(e, &attr);
+        fd[e] = syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+        if (fd[e] < 0) continue;
+        if (leader < 0) leader = fd[e];
+        ioctl(fd[e], PERF_EVENT_IOC_ID, &id[e]);
+      }
+    }
+
+    void Start()
+    {
+      if (leader < 0) return;
+      ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+      ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+
+    void Stop()
+    {
+      if (leader < 0) return;
+      ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    }
+
+    // Add the counts of this group to the totals
+    // Counts are scaled up if the group was multiplexed with other users
+
+    void Accumulate(PerfTotals* t)
+    {
+      if (leader < 0) return;
+      unsigned long long buf[3 + 2 * PERF_EVENTS];
+      if (read(leader, buf, sizeof(buf)) <= 0) return;
+      unsigned long long nr = buf[0];
+      double scale = (buf[2] == 0) ? 0.0 : (double)buf[1] / buf[2];
+      for (unsigned long long k = 0; k < nr; k++) {
+        for (int e = 0; e < PERF_EVENTS; e++) {
+          if (fd[e] >= 0 && id[e] == buf[4 + 2 * k]) {
+            t->count[e].fetch_add((unsigned long long)(buf[3 + 2 * k] * scale));
+            t->present[e].fetch_add(1);
+          }
+        }
+      }
+    }
+
+    void Close()
+    {
+      for (int e = 0; e < PERF_EVENTS; e++) {
+        if (fd[e] >= 0) close(fd[e]);
+        fd[e] = -1;
+      }
+      leader = -1;
+    }
+};
+
+#endif // PERFCTR_H
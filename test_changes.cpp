@@ -0,0 +1,99 @@
+// Checks the change stream of LockFreeHashTable.cpp against the table
+//
+// Writers add and delete a few hot keys while one more thread drains the
+// stream. Taken in sequence order, the records of a key must alternate
+// between add and delete, starting with an add, and once the writers stop the
+// last one must be an add exactly when the key is present. An add numbered
+// before a change it took effect after shows up as two adds in a row.
+//
+// g++ -O3 -fopenmp -DCHANGE_STREAM -o test_changes test_changes.cpp
+// ./test_changes [writers]
+
+#ifndef CHANGE_STREAM
+#error "compile with -DCHANGE_STREAM"
+#endif
+
+#define NUM_ITEMS 1     // The benchmark's arrays are not used
+#define LFHT_NO_MAIN
+#include "LockFreeHashTable.cpp"
+#include <algorithm>
+
+#define TEST_KEYS 64        // Keys 10 .. 10+TEST_KEYS-1
+#define TEST_OPS 200000     // Adds and deletes per writer
+
+std::vector<ChangeRecord> stream;   // Written by the draining thread only
+
+// Drain until the writers are done and the stream is empty
+void Drain(std::atomic<int>* running) {
+  ChangeRecord batch[1024];
+  while (true) {
+    bool done=running->load(std::memory_order_acquire)==0;
+    long n=DrainChanges(batch, 1024);
+    stream.insert(stream.end(), batch, batch+n);
+    if (n==0 && done) return;
+    if (n==0) sched_yield();
+  }
+}
+
+bool BySeq(const ChangeRecord& a, const ChangeRecord& b) {
+  return a.seq<b.seq;
+}
+
+bool Odd(LL key, void*) {
+  return key&1;
+}
+
+// Check the order of every key's records and compare the last with the table
+long Check(const char* phase) {
+  std::vector<ChangeRecord> sorted(stream);
+  std::sort(sorted.begin(), sorted.end(), BySeq);
+  int state[TEST_KEYS];     // Op of the key's last record, CHANGE_DELETE if none
+  for (int k=0;k<TEST_KEYS;k++) state[k]=CHANGE_DELETE;
+  long misordered=0, bad=0;
+  for (size_t i=0;i<sorted.size();i++) {
+    int* s=&state[sorted[i].key-10];
+    if (sorted[i].op==*s) misordered++;
+    *s=sorted[i].op;
+  }
+  for (int k=0;k<TEST_KEYS;k++) {
+    if ((state[k]==CHANGE_ADD)!=h.Search(k+10)) bad++;
+  }
+  printf("%s: records %ld misordered %ld mismatches %ld\n", phase, (long)sorted.size(), misordered, bad);
+  return misordered+bad;
+}
+
+int main(int argc, char** argv) {
+  int writers=argc>1 ? atoi(argv[1]) : 4;
+  std::atomic<int> running(writers);
+  ChangeConsumer();   // Full rings wait for the drain, so nothing is dropped
+  #pragma omp parallel num_threads(writers+1)
+  {
+    int tid=omp_get_thread_num();
+    if (tid==writers) {
+      Drain(&running);
+    } else {
+      unsigned seed=tid+1;
+      for (long i=0;i<TEST_OPS;i++) {
+        LL key=10+rand_r(&seed)%TEST_KEYS;
+        if (rand_r(&seed)&1) {
+#ifdef COUNTING
+          h.Increment(key, 1);
+#else
+          h.Add(key, NULL);
+#endif
+        } else {
+          h.Delete(key);
+        }
+      }
+      running.fetch_sub(1, std::memory_order_release);
+    }
+  }
+  long bad=Check("add/delete");
+
+  // EraseIf removals are streamed too
+  h.EraseIf(Odd, NULL);
+  running.store(0, std::memory_order_relaxed);
+  Drain(&running);
+  bad+=Check("erase odd keys");
+  return bad!=0;
+}
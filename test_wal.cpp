@@ -0,0 +1,157 @@
+// Round trips of the write-ahead log: snapshot, more changes, crash or close,
+// recover, compare
+//
+// Crash: a child process logs in WAL_SYNC mode, takes a snapshot halfway,
+// deletes its table and exits without WalClose. Every change it made had
+// returned, so was durable, and the recovered table must hold exactly the
+// keys the child ended with, from the snapshot and the log or from the log
+// alone. Close: the recovered table logs more changes in WAL_ASYNC mode on
+// top of a new snapshot and closes the log normally. Torn tail: a log cut
+// inside its last record replays every record but that one. The two crash
+// recoveries are live together, and the second keeps being used after the
+// first is deleted, so a table must not release the nodes of another.
+//
+// g++ -O3 -fopenmp -DWAL -o test_wal test_wal.cpp                (LockFreeHashTable.cpp)
+// g++ -O3 -fopenmp -DWAL -DTEST_LBHT -o test_wal test_wal.cpp    (lbht)
+
+#ifndef WAL
+#error "compile with -DWAL"
+#endif
+
+#ifdef TEST_LBHT
+#define LBHT_NO_MAIN
+#include "lbht.cpp"
+typedef lbht Table;
+
+bool Add(Table* t, LL key) {
+  return t->Insert(key);
+}
+#else
+#define NUM_ITEMS 1     // The benchmark's arrays are not used
+#define LFHT_NO_MAIN
+#include "LockFreeHashTable.cpp"
+typedef LockFreeHashTable Table;
+
+bool Add(Table* t, LL key) {
+  return t->Add(key, NULL);
+}
+#endif
+
+#include "sys/wait.h"
+#include <algorithm>
+
+#define TEST_KEYS 5000      // Keys 10 .. 10+TEST_KEYS-1
+#define TEST_OPS 10000      // Adds and deletes per phase
+
+#define LOG "test_wal.log"
+#define SNAP "test_wal.snap"
+#define EXPECT "test_wal.expect"
+#define KEYS "test_wal.keys"
+
+// Random adds and deletes from every thread
+void Work(Table* t, unsigned seed, long n) {
+  #pragma omp parallel
+  {
+    unsigned r=seed*7919+omp_get_thread_num();
+    #pragma omp for
+    for (long i=0;i<n;i++) {
+      LL key=10+rand_r(&r)%TEST_KEYS;
+      if (rand_r(&r)&1) Add(t, key);
+      else t->Delete(key);
+    }
+  }
+}
+
+bool Odd(LL key, void*) {
+  return key&1;
+}
+
+void Collect(int, unsigned long long key, void* arg) {
+  ((std::vector<LL>*)arg)->push_back(key);
+}
+
+// The sorted keys of a snapshot file
+std::vector<LL> Load(const char* path) {
+  std::vector<LL> keys;
+  unsigned long long seq;
+  if (WalLoadSnapshot(path, Collect, &keys, &seq)<0) printf("cannot load %s\n", path);
+  std::sort(keys.begin(), keys.end());
+  return keys;
+}
+
+// The sorted keys of a table; writers must be quiescent
+std::vector<LL> Keys(Table* t) {
+  t->Snapshot(KEYS);
+  return Load(KEYS);
+}
+
+long Compare(const char* what, long replayed, Table* t, const std::vector<LL>& expected) {
+  bool same=replayed>=0 && Keys(t)==expected;
+  printf("%s: replayed %ld keys %ld %s\n", what, replayed, (long)expected.size(), same ? "ok" : "MISMATCH");
+  return !same;
+}
+
+int main() {
+  unlink(LOG);
+  unlink(SNAP);
+
+  // Fork before any OpenMP thread exists
+  pid_t pid=fork();
+  if (pid==0) {
+    Table* t=new Table();
+    WalOpen(LOG, WAL_SYNC);
+    Work(t, 1, TEST_OPS);
+    t->Clear();
+    Work(t, 2, TEST_OPS);
+    t->Snapshot(SNAP);
+    Work(t, 3, TEST_OPS);
+    t->EraseIf(Odd, NULL);
+    Work(t, 4, TEST_OPS);
+    t->Snapshot(EXPECT);
+    delete t;     // Logs nothing
+    _exit(0);     // The committer dies with the process
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status)!=0) {
+    printf("crash run failed\n");
+    return 1;
+  }
+  long bad=0;
+  std::vector<LL> expected=Load(EXPECT);
+  Table* a=new Table();
+  bad+=Compare("crash, snapshot and log", a->Recover(SNAP, LOG), a, expected);
+  Table* b=new Table();
+  bad+=Compare("crash, log only", b->Recover(NULL, LOG), b, expected);
+  delete a;
+
+  // Later changes go to a new log on top of a new snapshot
+  unlink(LOG);
+  b->Snapshot(SNAP);
+  WalOpen(LOG, WAL_ASYNC);
+  Work(b, 5, TEST_OPS);
+  WalClose();
+  expected=Keys(b);
+  delete b;
+  Table* c=new Table();
+  long replayed=c->Recover(SNAP, LOG);
+  bad+=Compare("close, snapshot and log", replayed, c, expected);
+  delete c;
+
+  // Cut the log inside its last record
+  if (replayed<1 || truncate(LOG, replayed*sizeof(WalRecord)-sizeof(WalRecord)/2)!=0) {
+    printf("cannot cut the log\n");
+    return 1;
+  }
+  Table* d=new Table();
+  long torn=d->Recover(SNAP, LOG);
+  printf("torn tail: replayed %ld of %ld %s\n", torn, replayed, torn==replayed-1 ? "ok" : "MISMATCH");
+  bad+=torn!=replayed-1;
+  delete d;
+
+  unlink(LOG);
+  unlink(SNAP);
+  unlink(EXPECT);
+  unlink(KEYS);
+  return bad!=0;
+}
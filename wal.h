@@ -0,0 +1,350 @@
+// wal.h
+//
+// Write-ahead log of the tables, for adds and deletes that survive a crash.
+// Compile with -DWAL to enable. changes.h includes this file and hands it
+// every change it records, so the log holds exactly the changes of the change
+// stream, plus Clear.
+//
+// Each writer thread appends its records to its own single-producer ring. The
+// committer thread started by WalOpen drains every ring, writes what it found
+// with one write and makes it durable with one fdatasync, then publishes how
+// far each ring is durable. Records that arrive during an fdatasync go into
+// the next group, so one fdatasync covers the changes of every writer that
+// arrived meanwhile.
+//
+// Durability is chosen at WalOpen:
+//
+//   WAL_ASYNC  operations return at once; a change is durable about one
+//              commit round after it took effect
+//   WAL_SYNC   the tables call WalSync before an operation returns, outside
+//              any bucket lock, and it waits until every change the calling
+//              thread made is durable
+//
+// Records carry the sequence numbers of changes.h. Recovery reads the log,
+// sorts it by sequence number, and applies the records numbered above a
+// snapshot's number on top of that snapshot. Records of one key are numbered
+// in the order they took effect, so each key ends in the state of its last
+// change. A record torn by a crash ends the replay.
+//
+// Without the flag WalAppend and WalSync are empty and compile away.
+
+#ifndef WAL_H
+#define WAL_H
+
+#define WAL_ADD (0)       // Same as CHANGE_ADD
+#define WAL_DELETE (1)    // Same as CHANGE_DELETE
+#define WAL_CLEAR (2)
+
+#define WAL_ASYNC (0)
+#define WAL_SYNC (1)
+
+#ifdef WAL
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "stdint.h"
+#include "string.h"
+#include "fcntl.h"
+#include "unistd.h"
+#include "errno.h"
+#include "pthread.h"
+#include "sched.h"
+#include "backoff.h"
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+#ifndef WAL_SLOTS
+#define WAL_SLOTS 4096    // Records per ring, a power of two
+#endif
+
+#ifndef WAL_IDLE_US
+#define WAL_IDLE_US 100   // Committer sleep when no record is pending
+#endif
+
+static_assert((WAL_SLOTS & (WAL_SLOTS - 1)) == 0, "WAL_SLOTS must be a power of two");
+
+// A log record as written to the file
+struct WalRecord
+{
+  unsigned long long seq;
+  unsigned long long key;
+  unsigned op;
+  unsigned check;   // Tells a whole record from a torn or zeroed one
+};
+
+static_assert(sizeof(WalRecord) == 24, "log records are 24 bytes on disk");
+
+inline unsigned WalCheck(const WalRecord& r)
+{
+  uint64_t h = (r.seq * 0x9E3779B97F4A7C15ULL) ^ (r.key * 0xC2B2AE3D27D4EB4FULL) ^ r.op;
+  return (unsigned)(h ^ (h >> 32)) ^ 0xA5A5A5A5u;
+}
+
+class WalRing
+{
+public:
+  WalRecord slots[WAL_SLOTS];
+  alignas(64) std::atomic<unsigned long> tail;   // Written by the producer
+  unsigned long headCache;                       // Producer's view of head
+  alignas(64) std::atomic<unsigned long> head;   // Written by the committer
+  std::atomic<unsigned long> durable;            // Records made durable, by the committer
+  WalRing* link;                                 // Next ring in the registry
+
+  WalRing()
+  {
+    tail.store(0, std::memory_order_relaxed);
+    headCache = 0;
+    head.store(0, std::memory_order_relaxed);
+    durable.store(0, std::memory_order_relaxed);
+    link = NULL;
+  }
+};
+
+std::atomic<WalRing*> walRings(NULL);   // Every ring ever created
+__thread WalRing* myWal;
+
+// Set by WalOpen before the writers start and cleared by WalClose after they stop
+int walFd = -1;
+int walMode = WAL_ASYNC;
+pthread_t walCommitter;
+std::atomic<bool> walStop(false);
+std::atomic<int> walWaiting(0);         // Writers blocked in WalSync
+long walRecords, walSyncs;              // Written by the committer
+
+// The ring of the calling thread, created on first use; rings are never freed
+inline WalRing* MyWal()
+{
+  if (myWal == NULL) {
+    WalRing* r = new WalRing();
+    r->link = walRings.load(std::memory_order_relaxed);
+    while (!walRings.compare_exchange_weak(r->link, r, std::memory_order_release, std::memory_order_relaxed));
+    myWal = r;
+  }
+  return myWal;
+}
+
+// Log a change; does nothing while no log is open
+// Waits while the ring is full, so lbht appends through StageChange and
+// PublishChanges of changes.h, after it releases the bucket lock
+inline void WalAppend(int op, unsigned long long key, unsigned long long seq)
+{
+  if (walFd < 0) return;
+  WalRing* r = MyWal();
+  unsigned long t = r->tail.load(std::memory_order_relaxed);
+  // Full: spin briefly, then yield, in case the committer needs this CPU
+  for (int spins = 0; t - r->headCache == WAL_SLOTS; spins++) {
+    r->headCache = r->head.load(std::memory_order_acquire);
+    if (t - r->headCache != WAL_SLOTS) break;
+    if (spins < 64) CpuRelax();
+    else sched_yield();
+  }
+  WalRecord* rec = &r->slots[t & (WAL_SLOTS - 1)];
+  rec->seq = seq;
+  rec->key = key;
+  rec->op = op;
+  rec->check = WalCheck(*rec);
+  r->tail.store(t + 1, std::memory_order_release);
+}
+
+// In WAL_SYNC mode wait until every change of the calling thread is durable
+inline void WalSync()
+{
+  if (walFd < 0 || walMode != WAL_SYNC || myWal == NULL) return;
+  unsigned long t = myWal->tail.load(std::memory_order_relaxed);
+  if (myWal->durable.load(std::memory_order_acquire) >= t) return;
+  walWaiting.fetch_add(1, std::memory_order_relaxed);
+  for (int spins = 0; myWal->durable.load(std::memory_order_acquire) < t; spins++) {
+    if (spins < 64) CpuRelax();
+    else sched_yield();
+  }
+  walWaiting.fetch_sub(1, std::memory_order_relaxed);
+}
+
+// Commit rounds until WalClose; the round after the stop request drains what
+// is left. Rings are drained into one buffer, written, and synced once
+inline void* WalCommit(void*)
+{
+  std::vector<WalRecord> group;
+  std::vector<std::pair<WalRing*, unsigned long> > marks;
+  while (true) {
+    bool last = walStop.load(std::memory_order_acquire);
+    group.clear();
+    marks.clear();
+    for (WalRing* r = walRings.load(std::memory_order_acquire); r != NULL; r = r->link) {
+      unsigned long h = r->head.load(std::memory_order_relaxed);
+      unsigned long t = r->tail.load(std::memory_order_acquire);
+      if (h == t) continue;
+      for (; h != t; h++)
+        group.push_back(r->slots[h & (WAL_SLOTS - 1)]);
+      r->head.store(h, std::memory_order_release);
+      marks.push_back(std::make_pair(r, h));
+    }
+    if (group.empty()) {
+      if (last) return NULL;
+      if (walWaiting.load(std::memory_order_relaxed) > 0) sched_yield();
+      else usleep(WAL_IDLE_US);
+      continue;
+    }
+    const char* p = (const char*)&group[0];
+    size_t left = group.size() * sizeof(WalRecord);
+    while (left > 0) {
+      ssize_t w = write(walFd, p, left);
+      if (w < 0 && errno == EINTR) continue;   // Interrupted by a signal before writing
+      if (w < 0) {
+        printf("Write-ahead log write failed.\nAborting...\n");
+        exit(1);
+      }
+      p += w;
+      left -= w;
+    }
+    int synced;
+    while ((synced = fdatasync(walFd)) != 0 && errno == EINTR);
+    if (synced != 0) {
+      printf("Write-ahead log sync failed.\nAborting...\n");
+      exit(1);
+    }
+    walRecords += group.size();
+    walSyncs++;
+    for (size_t k = 0; k < marks.size(); k++)
+      marks[k].first->durable.store(marks[k].second, std::memory_order_release);
+  }
+}
+
+// Append to the log at path and start the committer; mode is WAL_ASYNC or
+// WAL_SYNC. Call before the writers start; returns false if the file cannot
+// be opened
+inline bool WalOpen(const char* path, int mode)
+{
+  int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd < 0) return false;
+  walFd = fd;
+  walMode = mode;
+  walRecords = walSyncs = 0;
+  walStop.store(false, std::memory_order_relaxed);
+  pthread_create(&walCommitter, NULL, WalCommit, NULL);
+  return true;
+}
+
+// Make every logged change durable and stop the committer; call after the
+// writers stop
+inline void WalClose()
+{
+  if (walFd < 0) return;
+  walStop.store(true, std::memory_order_release);
+  pthread_join(walCommitter, NULL);
+  close(walFd);
+  walFd = -1;
+}
+
+inline void WalReport()
+{
+  printf("wal records %ld fsyncs %ld records/fsync %.1lf\n", walRecords, walSyncs,
+         walSyncs > 0 ? (double)walRecords / walSyncs : 0.0);
+}
+
+// Called by recovery for every key of a snapshot (op WAL_ADD) and every
+// replayed record
+typedef void (*WalApply)(int op, unsigned long long key, void* arg);
+
+// Raise the sequence counter of changes.h past seq, so changes made after a
+// recovery are numbered above the ones it replayed
+inline void WalSeen(unsigned long long seq)
+{
+  unsigned long long cur = changeSeq.load(std::memory_order_relaxed);
+  while (cur < seq && !changeSeq.compare_exchange_weak(cur, seq, std::memory_order_relaxed));
+}
+
+// Sequence number to record with a snapshot; take it before reading the table
+inline unsigned long long WalSequence()
+{
+  return changeSeq.load(std::memory_order_acquire);
+}
+
+// Apply, in sequence order, the records of the log at path numbered above
+// after; reading stops at the first torn record
+// Returns the number of records applied, 0 if there is no log, or -1 if it
+// cannot be read
+inline long WalReplay(const char* path, unsigned long long after, WalApply apply, void* arg)
+{
+  FILE* f = fopen(path, "rb");
+  if (f == NULL) return access(path, F_OK) == 0 ? -1 : 0;
+  std::vector<WalRecord> records;
+  WalRecord r;
+  unsigned long long top = after;
+  while (fread(&r, sizeof(r), 1, f) == 1 && r.check == WalCheck(r)) {
+    if (r.seq > top) top = r.seq;
+    if (r.seq > after) records.push_back(r);
+  }
+  fclose(f);
+  std::sort(records.begin(), records.end(), [](const WalRecord& a, const WalRecord& b) {
+    return a.seq < b.seq;
+  });
+  for (size_t k = 0; k < records.size(); k++)
+    apply(records[k].op, records[k].key, arg);
+  WalSeen(top);
+  return records.size();
+}
+
+#define WAL_SNAPSHOT_MAGIC 0x3150414E53544857ULL   // "WHTSNAP1"
+
+struct WalSnapshotHeader
+{
+  unsigned long long magic;
+  unsigned long long seq;     // Changes numbered up to seq are in the keys
+  unsigned long long count;
+};
+
+// Write keys[0..n) as a snapshot taken at sequence number seq
+// The file is written aside, synced and renamed over path, so a crash leaves
+// the old snapshot or the new one
+inline bool WalSaveSnapshot(const char* path, const unsigned long long* keys, long n, unsigned long long seq)
+{
+  std::vector<char> tmp(path, path + strlen(path));
+  const char suffix[] = ".tmp";
+  tmp.insert(tmp.end(), suffix, suffix + sizeof(suffix));
+  FILE* f = fopen(&tmp[0], "wb");
+  if (f == NULL) return false;
+  WalSnapshotHeader hd = { WAL_SNAPSHOT_MAGIC, seq, (unsigned long long)n };
+  bool ok = fwrite(&hd, sizeof(hd), 1, f) == 1 &&
+            fwrite(keys, sizeof(unsigned long long), n, f) == (size_t)n &&
+            fflush(f) == 0 && fsync(fileno(f)) == 0;
+  ok = (fclose(f) == 0) && ok;
+  return ok && rename(&tmp[0], path) == 0;
+}
+
+// Hand every key of the snapshot at path to apply and store its sequence
+// number in *seq; returns the number of keys, or -1 if the file is unusable
+inline long WalLoadSnapshot(const char* path, WalApply apply, void* arg, unsigned long long* seq)
+{
+  FILE* f = fopen(path, "rb");
+  if (f == NULL) return -1;
+  WalSnapshotHeader hd;
+  if (fread(&hd, sizeof(hd), 1, f) != 1 || hd.magic != WAL_SNAPSHOT_MAGIC) {
+    fclose(f);
+    return -1;
+  }
+  unsigned long long key;
+  long n = 0;
+  for (; n < (long)hd.count && fread(&key, sizeof(key), 1, f) == 1; n++)
+    apply(WAL_ADD, key, arg);
+  fclose(f);
+  if (n != (long)hd.count) return -1;
+  *seq = hd.seq;
+  WalSeen(hd.seq);
+  return n;
+}
+
+#else
+
+inline void WalAppend(int op, unsigned long long key, unsigned long long seq)
+{
+}
+
+inline void WalSync()
+{
+}
+
+#endif // WAL
+
+#endif // WAL_H